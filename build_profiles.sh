@@ -0,0 +1,69 @@
+#!/bin/sh
+#
+# Build every firmware profile with the CCS compiler and report its size.
+#
+#   full        usb_to_gpib.c             both modes, ++debug messages
+#   controller  usb_to_gpib_controller.c  controller mode only
+#   device      usb_to_gpib_device.c      device mode and ++lon only
+#   debug       usb_to_gpib_debug.c       full plus VERBOSE_DEBUG traces
+#
+# Each profile leaves its own .hex next to its source. ROM and RAM use
+# come from the compiler's .sta file. The instruction count of the per-byte
+# routines comes from the .lst listing; at 4 clocks per instruction on the
+# 18.432MHz crystal that is 0.217us each, plus one more for every branch
+# taken, so it is a lower bound on the time spent per byte.
+#
+# Usage: ./build_profiles.sh [profile ...]
+# CCSC can be set to the compiler command, ccsc by default.
+
+CCSC=${CCSC:-ccsc}
+HOT="gpib_write_byte gpib_receive read_step rx_get RDA_isr"
+
+cd "$(dirname "$0")" || exit 1
+
+if [ $# -eq 0 ]; then
+    set -- full controller device debug
+fi
+
+status=0
+for profile in "$@"; do
+    case $profile in
+        full) src=usb_to_gpib ;;
+        controller|device|debug) src=usb_to_gpib_$profile ;;
+        *) echo "Unknown profile: $profile" >&2; exit 2 ;;
+    esac
+
+    if ! $CCSC +FH +Y9 +EA +LN +STDOUT $src.c; then
+        echo "$profile: build failed, see $src.err" >&2
+        status=1
+        continue
+    fi
+
+    echo "== $profile ($src.hex)"
+    grep -E 'ROM used|RAM used' $src.sta | sed 's/^[[:space:]]*/   /'
+
+    # Instruction lines in the listing start with their address, e.g.
+    # "0A2C:  MOVF   xx,W". Source lines before them name the function.
+    awk -v hot="$HOT" '
+        BEGIN { n = split(hot, h, " "); for (i = 1; i <= n; ++i) want[h[i]] = 1 }
+        /^\.+ / {
+            line = $0
+            sub(/^\.+[[:space:]]+/, "", line)
+            # A definition is a line that starts with its return type (or
+            # with the name, for the ISRs) and is not a statement
+            if (line ~ /;/ || line !~ /^[A-Za-z_][A-Za-z_0-9 *]*\(/) next
+            if (line ~ /^(if|while|for|switch|return|else)[^A-Za-z_0-9]/) next
+            name = line
+            sub(/[[:space:]]*\(.*/, "", name)
+            sub(/.*[ *]/, "", name)
+            cur = (name in want) ? name : ""
+            next
+        }
+        /^[0-9A-F]+:/ { if (cur != "") count[cur]++ }
+        END {
+            for (i = 1; i <= n; ++i)
+                if (h[i] in count)
+                    printf("   %-16s %4d instructions\n", h[i], count[h[i]])
+        }' $src.lst
+done
+exit $status
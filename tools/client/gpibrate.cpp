@@ -0,0 +1,117 @@
+/*
+* GPIBUSB Adapter
+* gpibrate.cpp
+**
+* © 2013-2014 Steven Casagrande (scasagrande@galvant.ca).
+*
+* This file is a part of the GPIBUSB Adapter project.
+* Licensed under the AGPL version 3.
+**
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU Affero General Public License for more details.
+*
+* You should have received a copy of the GNU Affero General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+**
+*
+* gpibrate - measure the query rate through the adapter with the client
+* library, pipelined and one at a time.
+*
+* Usage: gpibrate [-a address] [-n count] [-B baud] [-v] port [message]
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include <unistd.h>
+
+#include "gpibusb.h"
+
+static void usage()
+{
+    fprintf(stderr,
+        "Usage: gpibrate [options] port [message]\n"
+        "  -a N     instrument address (1)\n"
+        "  -n N     queries of each kind (1000)\n"
+        "  -B RATE  serial port baud rate (460800)\n"
+        "  -v       print the first response\n"
+        "The message is sent with EOI, \"*IDN?\" by default.\n");
+    exit(2);
+}
+
+static double seconds()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int main(int argc, char **argv)
+{
+    int address = 1;
+    long count = 1000;
+    unsigned long baud = 460800;
+    bool verbose = false;
+    std::string message = "*IDN?";
+    gpibusb::Client client;
+    long errors = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "a:n:B:vh")) != -1) {
+        switch (opt) {
+        case 'a': address = atoi(optarg); break;
+        case 'n': count = atol(optarg); break;
+        case 'B': baud = strtoul(optarg, NULL, 0); break;
+        case 'v': verbose = true; break;
+        default: usage();
+        }
+    }
+    if (optind >= argc || count < 1) {
+        usage();
+    }
+    if (optind + 1 < argc) {
+        message = argv[optind + 1];
+    }
+    if (!client.open(argv[optind], baud)) {
+        fprintf(stderr, "gpibrate: %s\n", client.error().c_str());
+        return 1;
+    }
+
+    // One at a time, waiting for each response like a simple host program
+    double start = seconds();
+    for (long i = 0; i < count; i++) {
+        gpibusb::Response r = client.query(address, message).get();
+        if (!r.ok()) {
+            errors++;
+        }
+        if (verbose && i == 0) {
+            printf("response: %s%s\n", r.data.c_str(), r.eoi ? " (EOI)" : "");
+        }
+    }
+    double serial = seconds() - start;
+
+    // Everything submitted at once, the client keeps the adapter busy
+    start = seconds();
+    for (long i = 0; i < count; i++) {
+        client.query(address, message, [&errors](const gpibusb::Response &r) {
+            if (!r.ok()) {
+                errors++; // Callbacks all run on the client's I/O thread
+            }
+        });
+    }
+    client.flush();
+    double pipelined = seconds() - start;
+
+    printf("one at a time: %8.1f queries/s\n", count / serial);
+    printf("pipelined:     %8.1f queries/s\n", count / pipelined);
+    if (errors) {
+        printf("%ld queries failed\n", errors);
+    }
+    return errors ? 1 : 0;
+}
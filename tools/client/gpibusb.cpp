@@ -0,0 +1,516 @@
+/*
+* GPIBUSB Adapter
+* gpibusb.cpp
+**
+* © 2013-2014 Steven Casagrande (scasagrande@galvant.ca).
+*
+* This file is a part of the GPIBUSB Adapter project.
+* Licensed under the AGPL version 3.
+**
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU Affero General Public License for more details.
+*
+* You should have received a copy of the GNU Affero General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+**
+*
+* See gpibusb.h.
+*
+* Requests are kept in one queue in submission order. The adapter handles
+* its input strictly in order, so the frames it sends back always belong
+* to the oldest request that hasn't completed:
+*
+*   query    binary packet(s) with BIN_READ on the last: one FRAME_ACK per
+*            packet, then the response frames up to FRAME_END
+*   write    binary packet(s): one FRAME_ACK per packet
+*   command  a text line, plus "++frame" if it has no answer of its own so
+*            that there is always a FRAME_END to complete it
+*
+* A frame for a request also means that the adapter has taken every byte
+* up to it out of its input ring. in_ring counts the bytes sent since the
+* last frame, and nothing is sent that would take it over ring_size.
+*/
+
+#include "gpibusb.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+typedef unsigned char BOOLEAN;
+extern "C" {
+#include "../../usb_to_gpib.h"
+}
+
+namespace gpibusb {
+
+static const size_t ring_size = 255; // Adapter's input ring, rx_buf
+static const size_t max_payload = 240; // Per packet, leaving room for ++addr
+static const char fence[] = "++frame\n"; // Answered with "1"
+
+Client::Client()
+    : reply_timeout(10000), fd(-1), stopping(false), unsent(0), in_ring(0),
+      address(-1), header_len(0), payload_left(0)
+{
+    wake_pipe[0] = wake_pipe[1] = -1;
+}
+
+Client::~Client()
+{
+    close();
+}
+
+static speed_t baud_constant(unsigned long baud)
+{
+    switch (baud) {
+    case 115200: return B115200;
+    case 230400: return B230400;
+    case 460800: return B460800;
+    case 921600: return B921600;
+#ifdef B1152000
+    case 1152000: return B1152000;
+#endif
+    default: return B0;
+    }
+}
+
+bool Client::open(const std::string &path, unsigned long baud)
+{
+    struct termios tio;
+    speed_t speed = baud_constant(baud);
+
+    close();
+    if (speed == B0) {
+        last_error = "unsupported baud rate";
+        return false;
+    }
+    fd = ::open(path.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (fd < 0) {
+        last_error = path + ": " + strerror(errno);
+        return false;
+    }
+    if (tcgetattr(fd, &tio) == 0) {
+        cfmakeraw(&tio);
+        cfsetispeed(&tio, speed);
+        cfsetospeed(&tio, speed);
+        tio.c_cflag |= CLOCAL | CREAD;
+        tcsetattr(fd, TCSANOW, &tio);
+        tcflush(fd, TCIOFLUSH);
+    }
+    if (pipe(wake_pipe) != 0) {
+        last_error = std::string("pipe: ") + strerror(errno);
+        ::close(fd);
+        fd = -1;
+        return false;
+    }
+    fcntl(wake_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK);
+
+    stopping = false;
+    unsent = 0;
+    in_ring = 0;
+    address = -1;
+    header_len = 0;
+    payload_left = 0;
+    io = std::thread(&Client::run, this);
+
+    // End any partial line left in the adapter, then turn framing on. The
+    // answer to the fence is the first frame.
+    Request *r = new_request(LINE, std::string("\n++frame 1\n") + fence, 1, false);
+    std::promise<Response> *p = new std::promise<Response>();
+    std::future<Response> f = p->get_future();
+    r->done = [p](const Response &response) {
+        p->set_value(response);
+        delete p;
+    };
+    submit(std::vector<Request *>(1, r), -1);
+    Response response = f.get();
+    if (!response.ok()) {
+        last_error = "no answer from the adapter";
+        close();
+        return false;
+    }
+    return true;
+}
+
+void Client::close()
+{
+    if (io.joinable()) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        wake();
+        io.join();
+    }
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+    for (int i = 0; i < 2; i++) {
+        if (wake_pipe[i] >= 0) {
+            ::close(wake_pipe[i]);
+            wake_pipe[i] = -1;
+        }
+    }
+}
+
+void Client::wake()
+{
+    char c = 0;
+    if (::write(wake_pipe[1], &c, 1) < 0) {
+        // Already has a wake up pending
+    }
+}
+
+Client::Request *Client::new_request(Kind kind, const std::string &bytes, int markers, bool reply)
+{
+    Request *r = new Request();
+    r->kind = kind;
+    r->bytes = bytes;
+    r->markers = markers;
+    r->reply = reply;
+    r->sent = false;
+    r->owner = NULL;
+    return r;
+}
+
+void Client::submit(std::vector<Request *> batch, int target)
+{
+    /*
+    * Queue the requests together, so that the packets of one message are
+    * never split up by another thread's. With a target, ++addr is put in
+    * front of the first one if the adapter is addressing another
+    * instrument by then.
+    */
+    std::vector<Request *> refused;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (fd < 0 || stopping) {
+            refused = batch;
+        }
+        else {
+            if (target >= 0 && target != address) {
+                char line[24];
+                snprintf(line, sizeof(line), "++addr %d\n", target);
+                batch.front()->bytes.insert(0, line);
+                address = target;
+            }
+            else if (target < 0 && batch.front()->bytes.compare(0, 6, "++addr") == 0) {
+                address = -1; // Changed by the caller, find out again
+            }
+            if (requests.empty()) {
+                deadline = std::chrono::steady_clock::now() + reply_timeout;
+            }
+            requests.insert(requests.end(), batch.begin(), batch.end());
+        }
+    }
+    for (size_t i = 0; i < refused.size(); i++) {
+        refused[i]->response.error = ERR_CLOSED;
+        if (refused[i]->done) {
+            refused[i]->done(refused[i]->response);
+        }
+        delete refused[i];
+    }
+    wake();
+}
+
+void Client::message(int target, const std::string &data, bool read, Callback done)
+{
+    /*
+    * Send data to target as binary packets of up to max_payload bytes,
+    * BIN_MORE on all but the last, which has BIN_EOI and BIN_READ for a
+    * query.
+    */
+    std::vector<Request *> batch;
+    size_t pos = 0;
+    do {
+        size_t length = data.size() - pos;
+        bool last;
+        unsigned char flags = BIN_MORE;
+        std::string bytes;
+        if (length > max_payload) {
+            length = max_payload;
+        }
+        last = pos + length == data.size();
+        if (last) {
+            flags = BIN_EOI | (read ? BIN_READ : 0);
+        }
+        bytes += (char)BIN_START;
+        bytes += (char)flags;
+        bytes += (char)length;
+        bytes.append(data, pos, length);
+        batch.push_back(new_request(PACKET, bytes, last && read ? 2 : 1, last && read));
+        pos += length;
+    } while (pos < data.size());
+    for (size_t i = 0; i < batch.size(); i++) {
+        batch[i]->owner = batch.back();
+    }
+    batch.back()->done = done;
+    submit(batch, target);
+}
+
+void Client::query(int target, const std::string &data, Callback done)
+{
+    message(target, data, true, done);
+}
+
+std::future<Response> Client::query(int target, const std::string &data)
+{
+    std::shared_ptr<std::promise<Response> > p(new std::promise<Response>());
+    query(target, data, [p](const Response &response) { p->set_value(response); });
+    return p->get_future();
+}
+
+void Client::write(int target, const std::string &data, Callback done)
+{
+    message(target, data, false, done);
+}
+
+void Client::command(const std::string &line, bool reply, Callback done)
+{
+    Request *r = new_request(LINE, line + "\n" + (reply ? "" : fence), 1, reply);
+    r->done = done;
+    submit(std::vector<Request *>(1, r), -1);
+}
+
+std::future<Response> Client::command(const std::string &line)
+{
+    std::shared_ptr<std::promise<Response> > p(new std::promise<Response>());
+    command(line, true, [p](const Response &response) { p->set_value(response); });
+    return p->get_future();
+}
+
+void Client::flush()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    idle.wait(guard, [this] { return requests.empty(); });
+}
+
+size_t Client::pending()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return requests.size();
+}
+
+bool Client::send_some()
+{
+    // Move as many unsent requests to out as the ring has room for, so
+    // that small requests go out together in one write. Must hold lock.
+    bool added = false;
+    while (unsent < requests.size()) {
+        Request *r = requests[unsent];
+        if (in_ring + r->bytes.size() > ring_size && in_ring > 0) {
+            break;
+        }
+        out += r->bytes;
+        in_ring += r->bytes.size();
+        r->sent = true;
+        unsent++;
+        added = true;
+    }
+    return added;
+}
+
+void Client::finish_front()
+{
+    // The oldest request is complete. Must hold lock; the callback is run
+    // by run() once the lock is released.
+    Request *r = requests.front();
+    requests.pop_front();
+    if (unsent > 0) {
+        unsent--;
+    }
+    if (requests.empty()) {
+        idle.notify_all();
+    }
+    else {
+        deadline = std::chrono::steady_clock::now() + reply_timeout;
+    }
+    if (r->owner != r && r->owner != NULL) {
+        // An early packet of a longer message, report its error with the last
+        if (!r->response.ok() && r->owner->response.ok()) {
+            r->owner->response.error = r->response.error;
+        }
+        delete r;
+        return;
+    }
+    if (!r->done) {
+        delete r;
+        return;
+    }
+    completed.push_back(r);
+}
+
+void Client::frame(unsigned char flags, unsigned char error)
+{
+    // A frame header has been parsed. Must hold lock.
+    Request *r;
+    if (requests.empty() || !requests.front()->sent) {
+        return; // Not ours, e.g. SRQ noise from before open()
+    }
+    in_ring = 0; // Everything sent before this frame has been consumed
+    for (size_t i = 0; i < unsent; i++) {
+        in_ring += requests[i]->bytes.size();
+    }
+    r = requests.front();
+    in_ring -= r->bytes.size();
+    r->bytes.clear();
+
+    if (error != FRAME_ERR_NONE && r->response.ok()) {
+        r->response.error = error;
+    }
+    if (flags & FRAME_ACK) {
+        if (--r->markers == 0 || error != FRAME_ERR_NONE) {
+            finish_front(); // No read follows an ACK with an error
+        }
+        return;
+    }
+    if (flags & FRAME_PACKED) {
+        r->response.packed = true;
+    }
+    if (flags & FRAME_END) {
+        r->response.eoi = (flags & FRAME_EOI) != 0;
+        if (--r->markers == 0) {
+            finish_front();
+        }
+    }
+}
+
+void Client::receive(const unsigned char *data, size_t length)
+{
+    // Parse response frames. Must hold lock.
+    size_t i = 0;
+    deadline = std::chrono::steady_clock::now() + reply_timeout;
+    while (i < length) {
+        if (header_len < 3) {
+            header[header_len++] = data[i++];
+            if (header_len == 3) {
+                payload_left = header[0];
+                if (payload_left == 0) {
+                    header_len = 0;
+                    frame(header[1], header[2]);
+                }
+            }
+            continue;
+        }
+        size_t n = length - i;
+        if (n > payload_left) {
+            n = payload_left;
+        }
+        if (!requests.empty() && requests.front()->sent && requests.front()->reply) {
+            requests.front()->response.data.append((const char *)data + i, n);
+        }
+        i += n;
+        payload_left -= n;
+        if (payload_left == 0) {
+            header_len = 0;
+            frame(header[1], header[2]);
+        }
+    }
+}
+
+void Client::fail_all(int error)
+{
+    // Give up on everything in flight. Must hold lock.
+    while (!requests.empty()) {
+        requests.front()->response.error = error;
+        requests.front()->markers = 0;
+        finish_front();
+    }
+    unsent = 0;
+    address = -1;
+    in_ring = 0;
+    out.clear();
+    header_len = 0;
+    payload_left = 0;
+}
+
+void Client::run()
+{
+    unsigned char buf[512];
+    for (;;) {
+        struct pollfd fds[2];
+        int timeout = -1;
+        std::vector<Request *> done;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            if (stopping) {
+                fail_all(ERR_CLOSED);
+                done.swap(completed);
+                guard.unlock();
+                for (size_t i = 0; i < done.size(); i++) {
+                    done[i]->done(done[i]->response);
+                    delete done[i];
+                }
+                return;
+            }
+            send_some();
+            if (unsent > 0 && out.empty()) {
+                std::chrono::steady_clock::duration left = deadline - std::chrono::steady_clock::now();
+                timeout = (int)std::chrono::duration_cast<std::chrono::milliseconds>(left).count() + 1;
+                if (timeout <= 0) {
+                    fail_all(ERR_NO_REPLY);
+                    timeout = -1;
+                }
+            }
+            fds[0].fd = fd;
+            fds[0].events = POLLIN | (out.empty() ? 0 : POLLOUT);
+            done.swap(completed);
+        }
+        for (size_t i = 0; i < done.size(); i++) {
+            done[i]->done(done[i]->response);
+            delete done[i];
+        }
+        if (!done.empty()) {
+            continue; // The callbacks may have submitted more
+        }
+
+        fds[1].fd = wake_pipe[0];
+        fds[1].events = POLLIN;
+        if (poll(fds, 2, timeout) < 0 && errno != EINTR) {
+            std::lock_guard<std::mutex> guard(lock);
+            fail_all(ERR_CLOSED);
+            continue;
+        }
+        if (fds[1].revents & POLLIN) {
+            while (read(wake_pipe[0], buf, sizeof(buf)) > 0) {
+            }
+        }
+        if (fds[0].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+            std::lock_guard<std::mutex> guard(lock);
+            fail_all(ERR_CLOSED);
+            stopping = true;
+            continue;
+        }
+        if (fds[0].revents & POLLOUT) {
+            std::lock_guard<std::mutex> guard(lock);
+            ssize_t n = ::write(fd, out.data(), out.size());
+            if (n > 0) {
+                out.erase(0, n);
+            }
+        }
+        if (fds[0].revents & POLLIN) {
+            ssize_t n = read(fd, buf, sizeof(buf));
+            if (n > 0) {
+                std::lock_guard<std::mutex> guard(lock);
+                receive(buf, n);
+            }
+        }
+    }
+}
+
+} // namespace gpibusb
@@ -0,0 +1,173 @@
+/*
+* GPIBUSB Adapter
+* gpibusb.h
+**
+* © 2013-2014 Steven Casagrande (scasagrande@galvant.ca).
+*
+* This file is a part of the GPIBUSB Adapter project.
+* Licensed under the AGPL version 3.
+**
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU Affero General Public License for more details.
+*
+* You should have received a copy of the GNU Affero General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+**
+*
+* Host client library for the adapter, in controller mode.
+*
+* Requests are queued and sent ahead of the responses to the earlier ones,
+* so the adapter always has the next command waiting in its input ring
+* instead of waiting a host round trip for it. Everything is sent with
+* ++frame 1 on: instrument messages go out as binary packets (BIN_START),
+* whose FRAME_ACK tells the client when the adapter has taken them out of
+* its ring, and every response comes back as frames ending in FRAME_END.
+* The client never has more unconsumed bytes in flight than the ring can
+* hold, so nothing is dropped however fast requests are submitted.
+*
+* Completions are delivered in submission order, on the client's I/O
+* thread. Callbacks must not block; they may submit further requests.
+*
+*     gpibusb::Client c;
+*     if (!c.open("/dev/ttyUSB0")) { ... c.error() ... }
+*     c.query(5, "MEAS?\n", [](const gpibusb::Response &r) { ... });
+*     std::future<gpibusb::Response> f = c.query(5, "*IDN?\n");
+*     c.flush();
+*/
+
+#ifndef GPIBUSB_H
+#define GPIBUSB_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace gpibusb {
+
+// Response::error, the adapter's FRAME_ERR_* codes plus host side errors
+enum {
+    ERR_NONE = 0,
+    ERR_TIMEOUT = 1, // FRAME_ERR_TIMEOUT, bus handshake timeout
+    ERR_ADDRESS = 2, // FRAME_ERR_ADDRESS, no listener on the bus
+    ERR_ABORT = 3, // FRAME_ERR_ABORT, ended by ++abort
+    ERR_NO_REPLY = 0x100, // The adapter didn't answer within reply_timeout
+    ERR_CLOSED = 0x101 // The client was closed, or the port failed
+};
+
+struct Response {
+    int error;
+    bool eoi; // The read was ended by EOI
+    bool packed; // data holds ++pack values, 4 bytes each
+    std::string data;
+
+    Response() : error(ERR_NONE), eoi(false), packed(false) {}
+    bool ok() const { return error == ERR_NONE; }
+};
+
+typedef std::function<void(const Response &)> Callback;
+
+class Client {
+public:
+    Client();
+    ~Client();
+
+    // Open a serial port (or pty) and switch the adapter to framed
+    // responses. Blocks until the adapter has answered.
+    bool open(const std::string &path, unsigned long baud = 460800);
+    void close();
+    const std::string &error() const { return last_error; }
+
+    // Write data to the instrument at address, with EOI on the last byte,
+    // then read its response. The callback gets the response.
+    void query(int address, const std::string &data, Callback done);
+    std::future<Response> query(int address, const std::string &data);
+
+    // Write data to the instrument at address, with EOI on the last byte.
+    // The callback gets an empty response once the adapter has written it.
+    void write(int address, const std::string &data, Callback done = Callback());
+
+    // An adapter command, e.g. "++srq" or "++spoll 5". With reply set the
+    // callback gets the adapter's answer; otherwise it is called as soon as
+    // a later response shows the command has been taken.
+    void command(const std::string &line, bool reply, Callback done = Callback());
+    std::future<Response> command(const std::string &line);
+
+    // Wait until everything submitted so far has completed
+    void flush();
+
+    // Queued and in-flight requests
+    size_t pending();
+
+    // Host side limit on waiting for each response, 10s by default. When
+    // it expires every request in flight fails with ERR_NO_REPLY.
+    std::chrono::milliseconds reply_timeout;
+
+private:
+    enum Kind { PACKET, LINE };
+
+    struct Request {
+        Kind kind;
+        std::string bytes; // As sent to the adapter
+        int markers; // FRAME_ACK and FRAME_END frames still to come
+        bool reply; // A FRAME_END completes it (else only the ACK)
+        bool sent;
+        Request *owner; // Last packet of the message, which reports errors
+        Response response;
+        Callback done;
+    };
+
+    Client(const Client &);
+    Client &operator=(const Client &);
+
+    static Request *new_request(Kind kind, const std::string &bytes, int markers, bool reply);
+    void submit(std::vector<Request *> batch, int target);
+    void message(int address, const std::string &data, bool read, Callback done);
+    void run();
+    bool send_some();
+    void receive(const unsigned char *data, size_t length);
+    void frame(unsigned char flags, unsigned char error);
+    void finish_front();
+    void fail_all(int error);
+    void wake();
+
+    int fd;
+    int wake_pipe[2];
+    std::thread io;
+    std::mutex lock;
+    std::condition_variable idle;
+    bool stopping;
+    std::string last_error;
+
+    // All below are guarded by lock
+    std::deque<Request *> requests; // In submission order
+    std::vector<Request *> completed; // Callbacks to run
+    size_t unsent; // Index of the first request not yet written
+    size_t in_ring; // Bytes sent that the adapter may not have consumed
+    int address; // ++addr as of the last request queued, -1 if unknown
+    std::string out; // Bytes being written
+    std::chrono::steady_clock::time_point deadline;
+
+    // Response frame being parsed
+    unsigned char header[3];
+    size_t header_len;
+    size_t payload_left;
+};
+
+} // namespace gpibusb
+
+#endif
@@ -0,0 +1,671 @@
+/*
+* GPIBUSB Adapter
+* gpibtrace.c
+**
+* © 2013-2014 Steven Casagrande (scasagrande@galvant.ca).
+*
+* This file is a part of the GPIBUSB Adapter project.
+* Licensed under the AGPL version 3.
+**
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU Affero General Public License for more details.
+*
+* You should have received a copy of the GNU Affero General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+**
+*
+* Host side decoder for the bus trace sent by the adapter in ++lon mode.
+* Captures are read as a stream of fixed size records, so files of any size
+* can be processed in constant memory:
+*
+*   gpibtrace decode [file]   One line per bus byte, with IEEE-488 mnemonics
+*   gpibtrace stats [file]    Per-talker transaction timing statistics
+*   gpibtrace replay [-c addr] [-r ns] [-a ns] [-t ns] [-q ns] [file]
+*                             Replay every transaction through the firmware
+*                             and the simulated bus of tools/sim, and
+*                             compare its duration with the capture
+*
+* With no file (or "-") the capture is read from stdin, so it can be piped
+* straight from the serial port.
+*
+* replay plays the adapter as the controller of the captured bus, at the
+* address given with -c (0 by default). A transaction the controller talks
+* is sent to the adapter as binary packets for its first listener, with EOI
+* if the capture had it. Any other is a ++read eoi from its talker, which
+* is a simulated instrument that replies with the captured bytes, EOI on
+* the last one. Both are timed from the first command byte to the last
+* data byte, as in the capture. The -r, -a, -t and -q instrument timings
+* are as for gpibbench.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "sim/ccs_host.h"
+#include "sim/sim.h"
+#include "../usb_to_gpib.h"
+
+#define RECORD_SIZE 4
+#define TICK_NS (8.0e9 / (18432000.0 / 4.0)) // Timer1 tick, 1.736us
+#define READ_CHUNK 65536
+#define MAX_ADDRESS 31
+#define HIST_BUCKETS 17
+#define REPLAY_PACKET 120
+#define REPLAY_TIMEOUT_NS 60000000000ULL // Simulated time per transaction
+
+struct record {
+    uint8_t flags;
+    uint8_t data;
+    uint16_t delta;
+    uint64_t time; // Ticks since the first record
+};
+
+struct talker_stats {
+    uint64_t transactions;
+    uint64_t bytes;
+    uint64_t ticks;
+    uint64_t min_ticks;
+    uint64_t max_ticks;
+};
+
+// Transaction currently being built up from the records
+struct transaction {
+    int talker; // -1 if no talker has been addressed
+    int listener; // First listener addressed after UNL
+    int listeners;
+    int in_data; // Data bytes seen since the last command byte
+    int timed; // 0 if a delta in this transaction overflowed
+    uint64_t start;
+    uint64_t end;
+    uint64_t command_bytes;
+    uint64_t data_bytes;
+    int eoi; // The last data byte had EOI
+    uint8_t *data; // The data bytes, if keep_data is set
+    size_t data_size;
+};
+
+static struct talker_stats talkers[MAX_ADDRESS + 1];
+static uint64_t data_hist[HIST_BUCKETS];
+static uint64_t overflows;
+static int keep_data;
+
+static const char *mnemonic(uint8_t byte, char *scratch)
+{
+    // IEEE-488 mnemonic for a byte sent with ATN asserted
+    byte &= 0x7f;
+    switch (byte) {
+    case CMD_GTL: return "GTL";
+    case CMD_SDC: return "SDC";
+    case 0x05: return "PPC";
+    case CMD_GET: return "GET";
+    case 0x09: return "TCT";
+    case CMD_LLO: return "LLO";
+    case CMD_DCL: return "DCL";
+    case 0x15: return "PPU";
+    case CMD_SPE: return "SPE";
+    case CMD_SPD: return "SPD";
+    case CMD_UNL: return "UNL";
+    case CMD_UNT: return "UNT";
+    }
+    if (byte >= 0x20 && byte < 0x3f) {
+        sprintf(scratch, "MLA %d", byte - 0x20);
+    } else if (byte >= 0x40 && byte < 0x5f) {
+        sprintf(scratch, "MTA %d", byte - 0x40);
+    } else if (byte >= 0x60) {
+        sprintf(scratch, "MSA %d", byte - 0x60);
+    } else {
+        sprintf(scratch, "CMD 0x%02x", byte);
+    }
+    return scratch;
+}
+
+static int bucket(uint16_t ticks)
+{
+    // log2 histogram bucket
+    int b = 0;
+    while (ticks > 1 && b < HIST_BUCKETS - 1) {
+        ticks >>= 1;
+        b++;
+    }
+    return b;
+}
+
+/*
+* Pull the next record out of the capture. The caller's chunk buffer is
+* refilled as needed, and a record split across two reads is stitched back
+* together. Returns 0 at end of input.
+*/
+static int next_record(FILE *in, struct record *rec)
+{
+    static uint8_t chunk[READ_CHUNK];
+    static size_t have, pos;
+    static uint64_t time;
+    static int first = 1;
+    uint8_t raw[RECORD_SIZE];
+    size_t got = 0;
+
+    while (got < RECORD_SIZE) {
+        if (pos == have) {
+            have = fread(chunk, 1, sizeof(chunk), in);
+            pos = 0;
+            if (have == 0) {
+                if (got) {
+                    fprintf(stderr, "gpibtrace: ignoring %zu trailing bytes\n", got);
+                }
+                return 0;
+            }
+        }
+        raw[got++] = chunk[pos++];
+    }
+
+    rec->flags = raw[0];
+    rec->data = raw[1];
+    rec->delta = (uint16_t)((raw[2] << 8) | raw[3]);
+    if (first) {
+        // Nothing came before the first record, its delta means nothing
+        first = 0;
+    } else {
+        time += rec->delta;
+    }
+    rec->time = time;
+    return 1;
+}
+
+static FILE *open_capture(const char *path)
+{
+    FILE *in;
+    if (path == NULL || strcmp(path, "-") == 0) {
+        return stdin;
+    }
+    in = fopen(path, "rb");
+    if (in == NULL) {
+        perror(path);
+        exit(1);
+    }
+    return in;
+}
+
+static int decode(FILE *in)
+{
+    struct record rec;
+    char scratch[16];
+
+    while (next_record(in, &rec)) {
+        printf("%14.3f us  ", rec.time * TICK_NS / 1000.0);
+        if (rec.flags & TRACE_OVF) {
+            printf("+gap ");
+        } else {
+            printf("     ");
+        }
+        if (rec.flags & TRACE_ATN) {
+            printf("ATN %02x  %-8s", rec.data, mnemonic(rec.data, scratch));
+        } else if (rec.data >= 32 && rec.data <= 126) {
+            printf("DAT %02x  '%c'     ", rec.data, rec.data);
+        } else {
+            printf("DAT %02x          ", rec.data);
+        }
+        if (rec.flags & TRACE_EOI) {
+            printf(" EOI");
+        }
+        if (rec.flags & TRACE_SRQ) {
+            printf(" SRQ");
+        }
+        printf("\n");
+    }
+    return 0;
+}
+
+static void transaction_reset(struct transaction *t, const struct record *rec)
+{
+    t->in_data = 0;
+    t->timed = 1;
+    t->start = rec->time;
+    t->end = rec->time;
+    t->command_bytes = 0;
+    t->data_bytes = 0;
+    t->eoi = 0;
+}
+
+static void transaction_add(struct transaction *t, uint8_t byte)
+{
+    // Count a data byte, keeping it for replay
+    if (keep_data) {
+        if (t->data_bytes == t->data_size) {
+            t->data_size = t->data_size ? t->data_size * 2 : 4096;
+            t->data = realloc(t->data, t->data_size);
+            if (t->data == NULL) {
+                perror("realloc");
+                exit(2);
+            }
+        }
+        t->data[t->data_bytes] = byte;
+    }
+    t->data_bytes++;
+}
+
+/*
+* Pull the next transaction out of the capture. A transaction starts with
+* the first command byte after a data phase and ends with the last data
+* byte before the next command byte (or at EOI). Returns 0 at end of input.
+* The data bytes in *out are only valid until the next call.
+*/
+static int next_transaction(FILE *in, struct transaction *out)
+{
+    static struct transaction t;
+    static int started, begun;
+    struct record rec;
+    int ready;
+
+    if (!begun) {
+        t.talker = t.listener = -1;
+        begun = 1;
+    }
+    while (next_record(in, &rec)) {
+        if (rec.flags & TRACE_OVF) {
+            overflows++;
+        }
+        if (rec.flags & TRACE_ATN) {
+            ready = 0;
+            if (!started || t.in_data) {
+                if (started && t.data_bytes) {
+                    *out = t;
+                    ready = 1;
+                }
+                transaction_reset(&t, &rec);
+                started = 1;
+            }
+            if (rec.flags & TRACE_OVF) {
+                t.timed = 0;
+            }
+            t.command_bytes++;
+            t.end = rec.time;
+            rec.data &= 0x7f;
+            if (rec.data == CMD_UNT) {
+                t.talker = -1;
+            } else if (rec.data == CMD_UNL) {
+                t.listeners = 0;
+                t.listener = -1;
+            } else if (rec.data >= 0x40 && rec.data < 0x5f) {
+                t.talker = rec.data - 0x40;
+            } else if (rec.data >= 0x20 && rec.data < 0x3f) {
+                if (t.listeners++ == 0) {
+                    t.listener = rec.data - 0x20;
+                }
+            }
+            if (ready) {
+                return 1;
+            }
+            continue;
+        }
+
+        if (!started) {
+            transaction_reset(&t, &rec);
+            started = 1;
+        }
+        if (t.in_data || t.command_bytes) {
+            if (rec.flags & TRACE_OVF) {
+                t.timed = 0;
+            } else if (t.in_data) {
+                data_hist[bucket(rec.delta)]++;
+            }
+        }
+        t.in_data = 1;
+        transaction_add(&t, rec.data);
+        t.end = rec.time;
+        if (rec.flags & TRACE_EOI) {
+            t.eoi = 1;
+            *out = t;
+            transaction_reset(&t, &rec);
+            started = 0;
+            return 1;
+        }
+    }
+    if (started && t.data_bytes) {
+        *out = t;
+        started = 0;
+        return 1;
+    }
+    return 0;
+}
+
+static void stats_done(const struct transaction *t)
+{
+    struct talker_stats *s;
+    uint64_t ticks = t->end - t->start;
+
+    s = &talkers[t->talker < 0 ? MAX_ADDRESS : t->talker];
+    if (!t->timed) {
+        return;
+    }
+    if (s->transactions == 0 || ticks < s->min_ticks) {
+        s->min_ticks = ticks;
+    }
+    if (ticks > s->max_ticks) {
+        s->max_ticks = ticks;
+    }
+    s->transactions++;
+    s->bytes += t->data_bytes;
+    s->ticks += ticks;
+}
+
+static int stats(FILE *in)
+{
+    int a, b;
+    struct talker_stats *s;
+    struct transaction t;
+
+    while (next_transaction(in, &t)) {
+        stats_done(&t);
+    }
+
+    printf("talker transactions bytes min_us avg_us max_us bytes_per_s\n");
+    for (a = 0; a <= MAX_ADDRESS; a++) {
+        s = &talkers[a];
+        if (s->transactions == 0) {
+            continue;
+        }
+        if (a == MAX_ADDRESS) {
+            printf("%6s", "none");
+        } else {
+            printf("%6d", a);
+        }
+        printf(" %12llu %5llu %6.1f %6.1f %6.1f %11.0f\n",
+               (unsigned long long)s->transactions,
+               (unsigned long long)s->bytes,
+               s->min_ticks * TICK_NS / 1000.0,
+               s->ticks * TICK_NS / 1000.0 / s->transactions,
+               s->max_ticks * TICK_NS / 1000.0,
+               s->ticks ? s->bytes / (s->ticks * TICK_NS / 1e9) : 0.0);
+    }
+
+    printf("\ndata byte spacing\n");
+    for (b = 0; b < HIST_BUCKETS; b++) {
+        if (data_hist[b]) {
+            printf("< %9.1f us %llu\n", (2 << b) * TICK_NS / 1000.0,
+                   (unsigned long long)data_hist[b]);
+        }
+    }
+    printf("\nuntimed gaps %llu\n", (unsigned long long)overflows);
+    return 0;
+}
+
+/*
+* Replay. The firmware's main loop runs the simulation and never returns,
+* so the replay is driven from host_step(), which the simulator calls at
+* every hardware access, one transaction at a time.
+*/
+
+enum { R_SETUP, R_WRITE, R_READ };
+
+static FILE *replay_in;
+static int controller;
+static struct instr_timing timing = { 500, 500, 500, 20000 };
+static int added[MAX_ADDRESS + 1];
+
+static struct transaction cur;
+static int r_state;
+static int r_started;
+static sim_ns r_start;
+static int replies_left;
+static uint64_t sent;
+static long unacked;
+
+// Bus bytes of the transaction being replayed, stamped as ++lon would
+static sim_ns bus_first, bus_last;
+static int bus_data_seen;
+
+// ++frame 1 response parser
+static unsigned char header[3];
+static int header_len;
+static int payload_left;
+
+static uint64_t replayed, skipped, errors;
+static double captured_ns, replayed_ns;
+
+static void bus_byte(unsigned char data, int atn, int eoi)
+{
+    (void)data;
+    (void)eoi;
+    if (r_state == R_SETUP || !r_started) {
+        return;
+    }
+    if (atn) {
+        if (bus_first == 0) {
+            bus_first = sim_now;
+        }
+    } else if (bus_first) {
+        bus_data_seen = 1;
+        bus_last = sim_now;
+    }
+}
+
+static void add_instr(int address)
+{
+    if (!added[address]) {
+        added[address] = 1;
+        sim_add_instr(address, &timing);
+    }
+}
+
+static void send_packets(void)
+{
+    // Keep the adapter's input ring full without overrunning it, as
+    // gpibbench does
+    unsigned char packet[3 + REPLAY_PACKET];
+    uint64_t length;
+    while (sent < cur.data_bytes && unacked + 3 + REPLAY_PACKET <= 255) {
+        length = cur.data_bytes - sent;
+        if (length > REPLAY_PACKET) {
+            length = REPLAY_PACKET;
+        }
+        packet[0] = BIN_START;
+        packet[1] = BIN_MORE;
+        if (sent + length == cur.data_bytes) {
+            packet[1] = cur.eoi ? BIN_EOI : 0;
+        }
+        packet[2] = (unsigned char)length;
+        memcpy(packet + 3, cur.data + sent, length);
+        sim_host_send(packet, 3 + length);
+        sent += length;
+        unacked += 3 + REPLAY_PACKET;
+        replies_left++;
+    }
+}
+
+static void replay_report(void)
+{
+    printf("total transactions %llu captured %.1f us replayed %.1f us "
+           "skipped %llu errors %llu\n",
+           (unsigned long long)replayed, captured_ns / 1000.0,
+           replayed_ns / 1000.0, (unsigned long long)skipped,
+           (unsigned long long)errors);
+    fflush(stdout);
+    exit(errors ? 1 : 0);
+}
+
+static void replay_next(void)
+{
+    // Start on the next transaction that can be replayed
+    char line[32];
+    for (;;) {
+        if (!next_transaction(replay_in, &cur)) {
+            replay_report();
+        }
+        if (!cur.timed || cur.talker < 0) {
+            skipped++;
+            continue;
+        }
+        if (cur.talker == controller) {
+            if (cur.listener < 0 || cur.listener == controller) {
+                skipped++;
+                continue;
+            }
+            r_state = R_WRITE;
+            add_instr(cur.listener);
+            snprintf(line, sizeof(line), "++addr %d\n", cur.listener);
+        } else {
+            r_state = R_READ;
+            add_instr(cur.talker);
+            sim_instr_reply(cur.talker, cur.data, (long)cur.data_bytes);
+            snprintf(line, sizeof(line), "++addr %d\n++read eoi\n", cur.talker);
+        }
+        break;
+    }
+    r_started = 1;
+    r_start = sim_now;
+    bus_first = bus_last = 0;
+    bus_data_seen = 0;
+    sent = 0;
+    unacked = 0;
+    replies_left = 0;
+    sim_host_send(line, strlen(line));
+    if (r_state == R_WRITE) {
+        send_packets();
+    } else {
+        replies_left = 1;
+    }
+}
+
+static void replay_done(void)
+{
+    double captured, simulated;
+
+    captured = (cur.end - cur.start) * TICK_NS;
+    simulated = bus_data_seen ? (double)(bus_last - bus_first) : 0.0;
+    replayed++;
+    captured_ns += captured;
+    replayed_ns += simulated;
+    printf("%8llu talker %3d cmd %3llu data %6llu captured %10.1f us "
+           "replayed %10.1f us ratio %5.2f\n",
+           (unsigned long long)replayed, cur.talker,
+           (unsigned long long)cur.command_bytes,
+           (unsigned long long)cur.data_bytes,
+           captured / 1000.0, simulated / 1000.0,
+           simulated > 0 ? captured / simulated : 0.0);
+    replay_next();
+}
+
+void host_step(void)
+{
+    if (!r_started) {
+        if (r_state == R_SETUP) {
+            // ++auto answers once the settings before it are in
+            sim_host_send("++frame 1\n++auto 0\n++auto\n", 26);
+            replies_left = 1;
+            r_started = 1;
+            r_start = sim_now;
+        }
+        return;
+    }
+    if (r_state == R_WRITE) {
+        send_packets();
+    }
+    if (replies_left <= 0 && sent == (r_state == R_WRITE ? cur.data_bytes : 0)) {
+        r_started = 0;
+        if (r_state == R_SETUP) {
+            replay_next();
+        } else {
+            replay_done();
+        }
+    } else if (sim_now - r_start > REPLAY_TIMEOUT_NS) {
+        fprintf(stderr, "gpibtrace: transaction %llu timed out at %.3fs\n",
+                (unsigned long long)replayed + 1, sim_now / 1e9);
+        errors++;
+        replay_report();
+    }
+}
+
+void host_rx(unsigned char c)
+{
+    // Count the ACK and END frames, skipping the data
+    if (header_len < 3) {
+        header[header_len++] = c;
+        if (header_len == 3) {
+            payload_left = header[0];
+            if (header[2] != FRAME_ERR_NONE) {
+                errors++;
+            }
+            if (header[1] & FRAME_ACK) {
+                unacked -= 3 + REPLAY_PACKET;
+            }
+        }
+    } else {
+        payload_left--;
+    }
+    if (header_len == 3 && payload_left == 0) {
+        header_len = 0;
+        if (header[1] & (FRAME_ACK | FRAME_END)) {
+            replies_left--;
+        }
+    }
+}
+
+static int replay(FILE *in)
+{
+    replay_in = in;
+    keep_data = 1;
+    sim_bus_byte = bus_byte;
+    firmware_main();
+    return 1;
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: gpibtrace decode [file]\n"
+            "       gpibtrace stats [file]\n"
+            "       gpibtrace replay [-c controller] [-r ready_ns] [-a accept_ns]\n"
+            "                        [-t settle_ns] [-q response_ns] [file]\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = NULL;
+    int i;
+
+    if (argc < 2) {
+        usage();
+    }
+    for (i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            controller = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            timing.ready = strtoull(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc) {
+            timing.accept = strtoull(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            timing.settle = strtoull(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "-q") == 0 && i + 1 < argc) {
+            timing.response = strtoull(argv[++i], NULL, 0);
+        } else if (path == NULL) {
+            path = argv[i];
+        } else {
+            usage();
+        }
+    }
+    if (controller < 0 || controller > 30) {
+        usage();
+    }
+
+    if (strcmp(argv[1], "decode") == 0) {
+        return decode(open_capture(path));
+    }
+    if (strcmp(argv[1], "stats") == 0) {
+        return stats(open_capture(path));
+    }
+    if (strcmp(argv[1], "replay") == 0) {
+        return replay(open_capture(path));
+    }
+    usage();
+    return 2;
+}
@@ -0,0 +1,299 @@
+#!/bin/sh
+#
+# Measure the firmware in instruction cycles by running the real hex image
+# in gpsim, and check the results against the budgets file if it has any.
+#
+#   write_byte    cycles between gpib_write_byte calls while writing a line
+#                 to an acceptor that answers at once (write.stc)
+#   receive_byte  cycles between gpib_receive calls while reading from a
+#                 talker that answers at once, in device mode (read.stc)
+#   cmd:++xxx     cycles from the stop bit of the command's LF to the
+#                 reply_int call that answers it (commands.stc)
+#
+# The host link is simulated at 460800 baud, 10 instruction cycles per bit
+# on the 18.432MHz crystal. Build the firmware first (./build_profiles.sh
+# full); the symbol addresses are looked up in the .lst next to the hex,
+# and a hex older than its .c source is refused.
+#
+# The host bytes are sent once the firmware is ready for them, at the
+# first host_poll call of each run: the startup takes as long as the bus
+# lets it (the DCL it sends waits out its timeout on a bus with no
+# acceptor), and bytes sent before INT_RDA is enabled are lost.
+#
+# Usage: tools/gpsim/cycles.sh [-u] hex
+# GPSIM can be set to the simulator command, gpsim by default. Exits 1 if
+# any measurement could not be taken or is over its budget; one with no
+# budget is only printed. With -u the budgets file is rewritten from this
+# run instead, with MARGIN percent (10 by default) on top of each
+# measurement.
+
+GPSIM=${GPSIM:-gpsim}
+MARGIN=${MARGIN:-10}
+UPDATE=0
+if [ "$1" = "-u" ]; then
+    UPDATE=1
+    shift
+fi
+HERE=$(cd "$(dirname "$0")" && pwd)
+if [ $# -ne 1 ]; then
+    echo "Usage: $0 [-u] hex" >&2
+    exit 2
+fi
+HEX=$1
+LST=${HEX%.hex}.lst
+BIT=10 # Cycles per bit at 460800 baud
+LEAD=1000 # Cycles from the first host_poll call to the first host byte
+SAMPLES=150
+
+for f in "$HEX" "$LST"; do
+    if [ ! -f "$f" ]; then
+        echo "$f not found, build the firmware first" >&2
+        exit 2
+    fi
+done
+if [ "${HEX%.hex}.c" -nt "$HEX" ]; then
+    echo "$HEX is older than ${HEX%.hex}.c, build the firmware first" >&2
+    exit 2
+fi
+
+WORK=$(mktemp -d) || exit 2
+trap 'rm -rf "$WORK"' EXIT
+cp "$HERE"/*.stc "$WORK"
+cp "$HEX" "$WORK/usb_to_gpib.hex"
+
+entry() {
+    # Address of the first instruction of function $1 in the listing
+    awk -v want="$1" '
+        /^\.+ / {
+            line = $0
+            sub(/^\.+[[:space:]]+/, "", line)
+            if (line ~ /;/ || line !~ /^[A-Za-z_][A-Za-z_0-9 *]*\(/) next
+            name = line
+            sub(/[[:space:]]*\(.*/, "", name)
+            sub(/.*[ *]/, "", name)
+            found = (name == want)
+            next
+        }
+        found && /^[0-9A-F]+:/ { sub(/:.*/, ""); print "0x" $0; exit }
+    ' "$LST"
+}
+
+uart() {
+    # asynchronous_stimulus on RX sending each argument as a line, $GAP
+    # cycles apart from $AT. Prints the cycle each line's LF ends on to
+    # $WORK/ends.
+    awk -v at="$AT" -v gap="$GAP" -v bit=$BIT -v ends="$WORK/ends" '
+        BEGIN {
+            for (i = 0; i < 256; ++i) ord[sprintf("%c", i)] = i
+            print "stimulus asynchronous_stimulus"
+            print "initial_state 1"
+            print "start_cycle 0"
+            print "period 0"
+            printf "{"
+            sep = ""
+            t = at
+            for (a = 1; a < ARGC; ++a) {
+                s = ARGV[a] "\n"
+                for (k = 1; k <= length(s); ++k) {
+                    c = ord[substr(s, k, 1)]
+                    printf "%s %d, 0", sep, t; sep = ","
+                    for (b = 0; b < 8; ++b) {
+                        printf ", %d, %d", t + (b + 1) * bit, int(c / 2^b) % 2
+                    }
+                    printf ", %d, 1", t + 9 * bit
+                    t += 10 * bit
+                }
+                print t > ends
+                t += gap
+            }
+            print " }"
+            print "name rxstim"
+            print "end"
+            print "attach nRX rxstim"
+            exit
+        }' "$@"
+}
+
+edges() {
+    # asynchronous_stimulus $1 on node $2, given as "cycle value" pairs
+    name=$1
+    node=$2
+    shift 2
+    echo "stimulus asynchronous_stimulus"
+    echo "initial_state 1"
+    echo "start_cycle 0"
+    echo "period 0"
+    printf "{"
+    sep=""
+    while [ $# -gt 1 ]; do
+        printf "%s %s, %s" "$sep" "$1" "$2"
+        sep=","
+        shift 2
+    done
+    echo " }"
+    echo "name $name"
+    echo "end"
+    echo "attach $node $name"
+}
+
+run_gpsim() {
+    # Run $1.stc with a break on $2, printing the cycle count of the first
+    # $3 hits one per line
+    {
+        echo "load $1.stc"
+        echo "break e $2"
+        i=0
+        while [ $i -lt "$3" ]; do
+            echo "run"
+            echo "cycles"
+            i=$((i + 1))
+        done
+        echo "quit"
+    } > "$WORK/run_$1.stc"
+    (cd "$WORK" && $GPSIM -i -c "run_$1.stc" 2>&1) |
+        awk '
+            function value(s,    n, i) {
+                if (s !~ /^0x/) return s + 0
+                n = 0
+                for (i = 3; i <= length(s); ++i)
+                    n = n * 16 + index("0123456789abcdef", tolower(substr(s, i, 1))) - 1
+                return n
+            }
+            /^cycles/ { sub(/.*=[[:space:]]*/, ""); sub(/[[:space:]].*/, ""); printf "%d\n", value($0) }'
+}
+
+spacing() {
+    # min, mean and max of the differences between successive lines of
+    # stdin, skipping the first $1
+    awk -v skip="$1" '
+        NR > 1 && NR > skip + 1 {
+            d = $1 - prev
+            if (n == 0 || d < min) min = d
+            if (d > max) max = d
+            sum += d; ++n
+        }
+        { prev = $1 }
+        END { if (n) printf "%d %.1f %d\n", min, sum / n, max; else print "- - -" }'
+}
+
+budget() {
+    # Budget for $1 from the budgets file, exact name or a prefix:* entry
+    awk -v name="$1" '
+        /^#/ || NF < 2 { next }
+        $1 == name { exact = $2 }
+        $1 ~ /\*$/ && index(name, substr($1, 1, length($1) - 1)) == 1 { wild = $2 }
+        END { print (exact != "") ? exact : wild }' "$HERE/budgets"
+}
+
+ready() {
+    # Cycle to start the host bytes of $1.stc at: LEAD cycles after the
+    # first host_poll call, once the startup is over and INT_RDA is on
+    t=$(run_gpsim "$1" $(entry host_poll) 1)
+    if [ -z "$t" ]; then
+        echo "$1.stc: host_poll never reached" >&2
+        exit 2
+    fi
+    echo $((t + LEAD))
+}
+
+status=0
+check() {
+    # check name value: print the result and compare with the budget, if
+    # there is one. A measurement that could not be taken fails. With -u
+    # the value is kept for the new budgets file instead.
+    limit=$(budget "$1")
+    case $2 in
+        ''|*[!0-9]*)
+            verdict="  MISSING"
+            status=1
+            ;;
+        *)
+            if [ $UPDATE -eq 1 ]; then
+                echo "$1 $2" >> "$WORK/measured"
+                verdict=""
+            elif [ -z "$limit" ]; then
+                verdict="  (no budget)"
+            elif [ "$2" -gt "$limit" ]; then
+                verdict="  OVER budget $limit"
+                status=1
+            else
+                verdict="  (budget $limit)"
+            fi
+            ;;
+    esac
+    printf "   %-18s %6s cycles%s\n" "$1" "${2:--}" "$verdict"
+}
+
+for sym in gpib_write_byte gpib_receive reply_int host_poll; do
+    if [ -z "$(entry $sym)" ]; then
+        echo "$sym not found in $LST" >&2
+        exit 2
+    fi
+done
+
+LINE=$(printf 'A%.0s' $(seq 200))
+
+# Writing
+AT=$(ready write) || exit 2
+AT=$AT GAP=20000 uart "++auto 0" "$LINE" > "$WORK/uart.stc"
+echo "load uart.stc" >> "$WORK/write.stc"
+set -- $(run_gpsim write $(entry gpib_write_byte) 190 | spacing 20)
+echo "== write (min/mean/max per byte: $1 $2 $3)"
+check write_byte "$3"
+
+# Reading in device mode: the talker is enabled with ATN low and MLA on
+# the bus, then ATN is released with "A" on the bus. The talker stays
+# off until then, so the startup runs with the phase left out.
+edges talkstim nTalk 0 0 > "$WORK/read_phase.stc"
+AT=$(ready read) || exit 2
+AT=$AT GAP=20000 uart "++mode 0" > "$WORK/read_phase.stc"
+T_ATN=$(( $(cat "$WORK/ends") + 100000 ))
+T_DATA=$((T_ATN + 2000))
+{
+    edges talkstim nTalk 0 0 $T_ATN 1
+    edges atnstim nATN $T_ATN 0 $T_DATA 1
+    edges dio6stim nDIO6 $T_ATN 0 $T_DATA 1
+    edges dio7stim nDIO7 $T_DATA 0
+} >> "$WORK/read_phase.stc"
+set -- $(run_gpsim read $(entry gpib_receive) 200 | tail -n $SAMPLES | spacing 0)
+echo "== read (min/mean/max per byte: $1 $2 $3)"
+check receive_byte "$3"
+
+# Commands, one at a time. Later commands in the dispatch chain cost more.
+CMDS="++addr ++auto ++read_tmo_ms ++t1 ++frame ++pack ++savecfg ++srq +ver ++eot_char ++mode"
+AT=$(ready commands) || exit 2
+AT=$AT GAP=50000 uart $CMDS > "$WORK/uart.stc"
+echo "load uart.stc" >> "$WORK/commands.stc"
+run_gpsim commands $(entry reply_int) $(echo $CMDS | wc -w) > "$WORK/hits"
+echo "== commands (LF received to reply)"
+set -- $CMDS
+paste "$WORK/ends" "$WORK/hits" | {
+    while read -r end hit; do
+        if [ -n "$hit" ]; then
+            check "cmd:$1" $((hit - end))
+        else
+            check "cmd:$1" ""
+        fi
+        shift
+    done
+    exit $status
+} || status=1
+
+if [ $UPDATE -eq 1 ]; then
+    if [ $status -ne 0 ]; then
+        echo "Not updating $HERE/budgets, a measurement is missing" >&2
+        exit 1
+    fi
+    {
+        sed '/^$/q' "$HERE/budgets"
+        echo "# Baseline from $(basename "$HEX"), $(date +%Y-%m-%d), +$MARGIN%:"
+        awk -v margin="$MARGIN" '{
+            n = $2 * (100 + margin) / 100
+            printf "%-15s %d\n", $1, (n == int(n)) ? n : int(n) + 1
+        }' "$WORK/measured"
+    } > "$WORK/budgets"
+    cp "$WORK/budgets" "$HERE/budgets"
+    echo "Wrote $HERE/budgets"
+fi
+
+exit $status
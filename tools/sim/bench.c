@@ -0,0 +1,416 @@
+/*
+* GPIBUSB Adapter
+* bench.c
+**
+* © 2013-2014 Steven Casagrande (scasagrande@galvant.ca).
+*
+* This file is a part of the GPIBUSB Adapter project.
+* Licensed under the AGPL version 3.
+**
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU Affero General Public License for more details.
+*
+* You should have received a copy of the GNU Affero General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+**
+*
+* gpibbench - run the adapter firmware on the host against simulated
+* instruments and report its throughput and latency.
+*
+* Each workload runs in its own process with a fresh adapter, and prints
+* one line of JSON to stdout:
+*
+*   query  ++frame 1, then -n "MEAS?" queries one at a time (auto read)
+*   block  one "DATA?" read of a -s byte definite-length block
+*   write  -s bytes written as a stream of binary packets
+*   srq    -n rounds of: instrument raises SRQ, ++srq, ++spoll
+*
+* All times are simulated: the firmware is charged a fixed number of
+* instruction cycles for each hardware access (see sim.c), so the results
+* are for comparing firmware changes with each other, not absolute.
+*
+* Usage: gpibbench [options] [workload ...]
+*/
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "ccs_host.h"
+#include "sim.h"
+#include "../../usb_to_gpib.h"
+
+#define INSTR_ADDRESS 1
+#define SRQ_ADDRESS 2
+#define OP_TIMEOUT_NS 60000000000ULL // Simulated time allowed per operation
+
+enum { OP_LINE, OP_STREAM, OP_SRQ };
+
+struct op {
+    int kind;
+    const char *text; // OP_LINE
+    int replies; // Response frames to wait for
+    int measure; // Counted in the results
+    sim_ns pause; // Wait after the previous operation before starting
+};
+
+static struct op ops[8];
+static int op_count;
+static long rounds = 1000;
+static long stream_size = 1000000;
+static int packet_size = 120;
+static unsigned long baud;
+static struct instr_timing timing = { 500, 500, 500, 20000 };
+static const char *workload;
+
+// Progress through ops[]
+static int op_index;
+static long op_round;
+static int op_started;
+static sim_ns op_start;
+static sim_ns op_end;
+static int replies_left;
+
+// Binary stream
+static long stream_sent;
+static long unacked;
+
+// Frame parser
+static unsigned char header[3];
+static int header_len;
+static int payload_left;
+static unsigned char last_payload;
+
+// Results
+static sim_ns *latency;
+static long latency_count, latency_size;
+static sim_ns bench_start, bench_end;
+static int measuring;
+static uint64_t host_tx, host_rx_bytes, payload_bytes;
+static long errors;
+
+static void usage(void)
+{
+    fprintf(stderr,
+        "Usage: gpibbench [options] [query|block|write|srq ...]\n"
+        "  -n N     queries or SRQ rounds (1000)\n"
+        "  -s N     block read and write size in bytes (1000000)\n"
+        "  -p N     binary packet payload for write (120)\n"
+        "  -B RATE  switch the host link to RATE with ++baud first\n"
+        "  -r NS    instrument ready delay, DAV high to NRFD high (500)\n"
+        "  -a NS    instrument accept delay, DAV low to NDAC high (500)\n"
+        "  -t NS    instrument settle delay, data to DAV low (500)\n"
+        "  -q NS    instrument response delay, query to reply (20000)\n");
+    exit(2);
+}
+
+static void add_op(int kind, const char *text, int replies, int measure)
+{
+    ops[op_count].pause = 0;
+    ops[op_count].kind = kind;
+    ops[op_count].text = text;
+    ops[op_count].replies = replies;
+    ops[op_count].measure = measure;
+    op_count++;
+}
+
+static void send(const void *data, size_t length)
+{
+    sim_host_send(data, length);
+    if (measuring) {
+        host_tx += length;
+    }
+}
+
+static void send_packets(void)
+{
+    // Keep the adapter's input ring full without overrunning it
+    unsigned char packet[3 + 255];
+    int length;
+    while (stream_sent < stream_size && unacked + 3 + packet_size <= 255) {
+        length = packet_size;
+        if (stream_size - stream_sent < length) {
+            length = stream_size - stream_sent;
+        }
+        packet[0] = BIN_START;
+        packet[1] = BIN_MORE;
+        if (stream_sent + length == stream_size) {
+            packet[1] = BIN_EOI;
+        }
+        packet[2] = length;
+        memset(packet + 3, 'x', length);
+        send(packet, 3 + length);
+        stream_sent += length;
+        unacked += 3 + length;
+        replies_left++;
+    }
+}
+
+static void record_latency(sim_ns ns)
+{
+    if (latency_count == latency_size) {
+        latency_size = latency_size ? latency_size * 2 : 1024;
+        latency = realloc(latency, latency_size * sizeof(*latency));
+        if (!latency) {
+            perror("realloc");
+            exit(2);
+        }
+    }
+    latency[latency_count++] = ns;
+}
+
+static int cmp_ns(const void *a, const void *b)
+{
+    sim_ns x = *(const sim_ns *)a, y = *(const sim_ns *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(double p)
+{
+    long i;
+    if (latency_count == 0) {
+        return 0;
+    }
+    i = (long)(p * (latency_count - 1) + 0.5);
+    return latency[i] / 1000.0;
+}
+
+static void report(void)
+{
+    double elapsed = (bench_end - bench_start) / 1e9;
+    long count = latency_count;
+    if (elapsed <= 0) {
+        elapsed = 1e-9;
+    }
+    if (!strcmp(workload, "write")) {
+        payload_bytes = sim_instr_data_in(INSTR_ADDRESS);
+    }
+    qsort(latency, latency_count, sizeof(*latency), cmp_ns);
+    printf("{\"workload\":\"%s\",\"ops\":%ld,\"errors\":%ld,\"elapsed_s\":%.6f,"
+        "\"commands_per_s\":%.3f,\"host_tx_bytes\":%llu,\"host_rx_bytes\":%llu,"
+        "\"payload_bytes\":%llu,\"payload_bytes_per_s\":%.1f,"
+        "\"latency_us\":{\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"max\":%.1f},"
+        "\"uart_overruns\":%llu,"
+        "\"config\":{\"baud\":%lu,\"ready_ns\":%llu,\"accept_ns\":%llu,"
+        "\"settle_ns\":%llu,\"response_ns\":%llu,\"size\":%ld,\"packet\":%d}}\n",
+        workload, count, errors, elapsed, count / elapsed,
+        (unsigned long long)host_tx, (unsigned long long)host_rx_bytes,
+        (unsigned long long)payload_bytes, payload_bytes / elapsed,
+        percentile(0.50), percentile(0.90), percentile(0.99), percentile(1.0),
+        (unsigned long long)sim_overruns(),
+        baud ? baud : 460800UL, (unsigned long long)timing.ready,
+        (unsigned long long)timing.accept, (unsigned long long)timing.settle,
+        (unsigned long long)timing.response, stream_size, packet_size);
+    fflush(stdout);
+    exit(errors ? 1 : 0);
+}
+
+static void frame_done(void)
+{
+    header_len = 0;
+    if (header[1] & (FRAME_ACK | FRAME_END)) {
+        replies_left--;
+    }
+}
+
+void host_rx(unsigned char c)
+{
+    // Parse the ++frame 1 responses
+    if (measuring) {
+        host_rx_bytes++;
+    }
+    if (header_len < 3) {
+        header[header_len++] = c;
+        if (header_len == 3) {
+            payload_left = header[0];
+            if (header[2] != FRAME_ERR_NONE) {
+                errors++;
+            }
+            if (header[1] & FRAME_ACK) {
+                unacked -= 3 + packet_size;
+                if (unacked < 0) {
+                    unacked = 0;
+                }
+            }
+            if (payload_left == 0) {
+                frame_done();
+            }
+        }
+        return;
+    }
+    last_payload = c;
+    if (measuring) {
+        payload_bytes++;
+    }
+    if (--payload_left == 0) {
+        frame_done();
+    }
+}
+
+static void start_op(struct op *op)
+{
+    op_started = 1;
+    op_start = sim_now;
+    if (op->measure && !measuring) {
+        measuring = 1;
+        bench_start = sim_now;
+    }
+    replies_left = op->replies;
+    switch (op->kind) {
+    case OP_LINE:
+        send(op->text, strlen(op->text));
+        break;
+    case OP_STREAM:
+        stream_sent = 0;
+        unacked = 0;
+        send_packets();
+        break;
+    case OP_SRQ:
+        sim_instr_srq(SRQ_ADDRESS);
+        send(op->text, strlen(op->text));
+        break;
+    }
+}
+
+static void finish_op(struct op *op)
+{
+    op_started = 0;
+    op_end = sim_now;
+    if (op->kind == OP_SRQ && last_payload != 0x41) {
+        errors++; // The status byte should have RQS and bit 0 set
+    }
+    if (op->measure) {
+        record_latency(sim_now - op_start);
+        bench_end = sim_now;
+    }
+    if (++op_round >= (op->measure ? rounds : 1) || op->kind == OP_STREAM) {
+        op_round = 0;
+        if (++op_index == op_count) {
+            report();
+        }
+    }
+}
+
+void host_step(void)
+{
+    struct op *op;
+    if (op_index == op_count) {
+        return;
+    }
+    op = &ops[op_index];
+    if (!op_started) {
+        if (sim_now >= op_end + op->pause) {
+            start_op(op);
+        }
+        return;
+    }
+    if (op->kind == OP_STREAM) {
+        send_packets();
+    }
+    if (replies_left <= 0 && (op->kind != OP_STREAM || stream_sent == stream_size)) {
+        finish_op(op);
+    }
+    else if (sim_now - op_start > OP_TIMEOUT_NS) {
+        fprintf(stderr, "gpibbench: %s timed out at %.3fs with %d replies missing\n",
+            workload, sim_now / 1e9, replies_left);
+        errors++;
+        report();
+    }
+}
+
+static void run(const char *name)
+{
+    static char baud_cmd[32];
+    struct instr_timing srq_timing = timing;
+
+    workload = name;
+    sim_add_instr(INSTR_ADDRESS, &timing);
+    sim_add_instr(SRQ_ADDRESS, &srq_timing);
+
+    add_op(OP_LINE, "++frame 1\n++addr 1\n++auto\n", 1, 0);
+    if (baud) {
+        snprintf(baud_cmd, sizeof(baud_cmd), "++baud %lu\n", baud);
+        add_op(OP_LINE, baud_cmd, 1, 0);
+        add_op(OP_LINE, "++baud\n", 1, 0);
+        ops[op_count - 1].pause = 1000000; // Let the adapter switch first
+    }
+
+    if (!strcmp(name, "query")) {
+        add_op(OP_LINE, "MEAS?\n", 1, 1);
+    }
+    else if (!strcmp(name, "block")) {
+        sim_block_size = stream_size;
+        add_op(OP_LINE, "DATA?\n", 1, 1);
+        rounds = 1;
+    }
+    else if (!strcmp(name, "write")) {
+        add_op(OP_STREAM, NULL, 0, 1);
+    }
+    else if (!strcmp(name, "srq")) {
+        add_op(OP_SRQ, "++srq\n++spoll 2\n", 2, 1);
+    }
+    else {
+        fprintf(stderr, "gpibbench: unknown workload %s\n", name);
+        exit(2);
+    }
+
+    firmware_main();
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int opt, i, status = 0;
+    static char *all[] = { "query", "block", "write", "srq" };
+
+    while ((opt = getopt(argc, argv, "n:s:p:B:r:a:t:q:h")) != -1) {
+        switch (opt) {
+        case 'n': rounds = strtol(optarg, NULL, 0); break;
+        case 's': stream_size = strtol(optarg, NULL, 0); break;
+        case 'p': packet_size = strtol(optarg, NULL, 0); break;
+        case 'B': baud = strtoul(optarg, NULL, 0); break;
+        case 'r': timing.ready = strtoull(optarg, NULL, 0); break;
+        case 'a': timing.accept = strtoull(optarg, NULL, 0); break;
+        case 't': timing.settle = strtoull(optarg, NULL, 0); break;
+        case 'q': timing.response = strtoull(optarg, NULL, 0); break;
+        default: usage();
+        }
+    }
+    if (rounds < 1 || stream_size < 1 || packet_size < 1 || packet_size > 252) {
+        usage();
+    }
+    if (optind == argc) {
+        argv = all;
+        argc = 4;
+        optind = 0;
+    }
+
+    for (i = optind; i < argc; i++) {
+        pid_t pid;
+        int child;
+        fflush(stdout);
+        pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            return 2;
+        }
+        if (pid == 0) {
+            run(argv[i]);
+        }
+        waitpid(pid, &child, 0);
+        if (!WIFEXITED(child) || WEXITSTATUS(child) != 0) {
+            status = 1;
+        }
+    }
+    return status;
+}
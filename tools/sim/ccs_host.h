@@ -0,0 +1,125 @@
+/*
+* GPIBUSB Adapter
+* ccs_host.h
+**
+* © 2013-2014 Steven Casagrande (scasagrande@galvant.ca).
+*
+* This file is a part of the GPIBUSB Adapter project.
+* Licensed under the AGPL version 3.
+**
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU Affero General Public License for more details.
+*
+* You should have received a copy of the GNU Affero General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+**
+*
+* Stand-ins for the CCS types and built-in functions, so that the firmware
+* can be compiled for the host and run against sim.c. The Makefile strips
+* the CCS-only directives (#fuses, #use, #int_xxx...) from usb_to_gpib.c
+* and compiles the result with this header forced in first.
+*/
+
+#ifndef CCS_HOST_H
+#define CCS_HOST_H
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// CCS types. A plain int is 8 bits and unsigned in CCS; the Makefile
+// rewrites it to unsigned char in the firmware source, as a macro can't.
+#define int1 unsigned char
+#define int8 char
+#define int16 short
+#define int32 int
+typedef unsigned char boolean;
+typedef unsigned char BOOLEAN;
+typedef unsigned char byte;
+#define true 1
+#define false 0
+#define TRUE 1
+#define FALSE 0
+#define rom const
+
+enum {
+    PIN_A0 = 1, PIN_A1, PIN_A2, PIN_A3, PIN_A4, PIN_A5,
+    PIN_B0, PIN_B1, PIN_B2, PIN_B3, PIN_B4, PIN_B5, PIN_B6, PIN_B7,
+    PIN_C5, PIN_D4, PIN_D5, PIN_D6, PIN_D7, PIN_E0, PIN_E1,
+    SIM_PINS
+};
+
+enum {
+    GLOBAL = 1, INT_TIMER1, INT_TIMER2, INT_RDA, INT_TBE, INT_EEPROM
+};
+
+enum {
+    WDT_ON = 1, T2_DIV_BY_16, T1_INTERNAL = 0x10, T1_DIV_BY_8 = 0x20
+};
+
+enum {
+    WDT_TIMEOUT = 1, NORMAL_POWER_UP, RESET_INSTRUCTION, MCLR_FROM_RUN,
+    BROWNOUT_RESTART
+};
+
+// Pins and the data port
+void output_low(int pin);
+void output_high(int pin);
+void output_float(int pin);
+int input(int pin);
+void output_b(int value);
+int input_b(void);
+
+// Timing
+void delay_us(unsigned int us);
+void delay_ms(unsigned int ms);
+void delay_cycles(unsigned int cycles);
+void restart_wdt(void);
+void setup_wdt(int mode);
+void set_rtcc(int value);
+void setup_timer_2(int mode, int period, int postscale);
+void setup_timer_1(int mode);
+unsigned int get_timer1(void);
+
+// Interrupts and resets
+void enable_interrupts(int which);
+void disable_interrupts(int which);
+void clear_interrupt(int which);
+int interrupt_active(int which);
+int restart_cause(void);
+void reset_cpu(void);
+
+// EEPROM
+int read_eeprom(int address);
+void write_eeprom(int address, int value);
+
+// UART
+int sim_getc(void);
+void sim_putc(int c);
+int sim_trmt(void);
+int sim_printf(const char *format, ...);
+#define getc() sim_getc()
+#define putc(c) sim_putc(c)
+#define TRMT sim_trmt()
+extern unsigned char SPBRG, SPBRGH, BRG16, BRGH;
+
+// Called from the firmware's empty wait loops
+void sim_idle(void);
+
+// Library functions with CCS semantics
+#define bit_set(x, b) ((x) |= (1 << (b)))
+#define bit_clear(x, b) ((x) &= ~(1 << (b)))
+#define bit_test(x, b) (((x) >> (b)) & 1)
+#define make8(x, n) ((unsigned char)((x) >> (8 * (n))))
+#define make16(h, l) ((unsigned short)(((h) << 8) | (l)))
+#define make32(a, b, c, d) ((unsigned int32)(((unsigned int32)(a) << 24) | ((unsigned int32)(b) << 16) | ((unsigned int32)(c) << 8) | (d)))
+#define atoi32(s) ((unsigned int)strtoul((s), NULL, 10))
+
+#endif
@@ -0,0 +1,169 @@
+/*
+* GPIBUSB Adapter
+* fake.c
+**
+* © 2013-2014 Steven Casagrande (scasagrande@galvant.ca).
+*
+* This file is a part of the GPIBUSB Adapter project.
+* Licensed under the AGPL version 3.
+**
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU Affero General Public License for more details.
+*
+* You should have received a copy of the GNU Affero General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+**
+*
+* gpibfake - the adapter firmware on a pseudo terminal, for testing host
+* software without the hardware.
+*
+* The firmware runs against the simulated bus of sim.c, with instruments
+* at addresses 1 to -i (see sim.c for what they answer). The pty stands in
+* for the adapter's serial port: its name is printed on stdout, or linked
+* to with -l. Simulated time is held back to real time, so timeouts and
+* the UART rate behave as they would on the real adapter.
+*
+* Usage: gpibfake [-l link] [-i instruments] [-r ns] [-a ns] [-t ns] [-q ns]
+*/
+
+#define _XOPEN_SOURCE 600
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sim.h"
+
+#define POLL_NS 20000 // Look for host bytes this often, in simulated time
+
+static int master = -1;
+static sim_ns next_poll;
+static sim_ns wall_start;
+
+static sim_ns wall_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (sim_ns)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void host_step(void)
+{
+    unsigned char buf[256];
+    struct pollfd pfd;
+    sim_ns wall;
+    int wait_ms = 0;
+    ssize_t n;
+
+    if (sim_now < next_poll) {
+        return;
+    }
+    next_poll = sim_now + POLL_NS;
+
+    // Don't let simulated time run ahead of real time while the firmware
+    // has nothing to do but wait for the host
+    wall = wall_ns() - wall_start;
+    if (sim_now > wall + 1000000 && sim_host_queued() == 0) {
+        wait_ms = (sim_now - wall) / 1000000;
+    }
+
+    pfd.fd = master;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, wait_ms) > 0 && (pfd.revents & POLLIN)) {
+        n = read(master, buf, sizeof(buf));
+        if (n > 0) {
+            sim_host_send(buf, n);
+        }
+    }
+}
+
+void host_rx(unsigned char c)
+{
+    while (write(master, &c, 1) < 0 && errno == EINTR) {
+    }
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+        "Usage: gpibfake [options]\n"
+        "  -l PATH  make PATH a symlink to the pty\n"
+        "  -i N     instruments at addresses 1 to N (2)\n"
+        "  -r NS    instrument ready delay, DAV high to NRFD high (500)\n"
+        "  -a NS    instrument accept delay, DAV low to NDAC high (500)\n"
+        "  -t NS    instrument settle delay, data to DAV low (500)\n"
+        "  -q NS    instrument response delay, query to reply (20000)\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    struct instr_timing timing = { 500, 500, 500, 20000 };
+    struct termios tio;
+    const char *link = NULL;
+    const char *name;
+    int count = 2;
+    int opt, i, slave;
+
+    while ((opt = getopt(argc, argv, "l:i:r:a:t:q:h")) != -1) {
+        switch (opt) {
+        case 'l': link = optarg; break;
+        case 'i': count = atoi(optarg); break;
+        case 'r': timing.ready = strtoull(optarg, NULL, 0); break;
+        case 'a': timing.accept = strtoull(optarg, NULL, 0); break;
+        case 't': timing.settle = strtoull(optarg, NULL, 0); break;
+        case 'q': timing.response = strtoull(optarg, NULL, 0); break;
+        default: usage();
+        }
+    }
+    if (count < 1 || count > SIM_MAX_INSTR) {
+        usage();
+    }
+
+    master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) {
+        perror("gpibfake: pty");
+        return 1;
+    }
+    name = ptsname(master);
+    // Keep the slave open so that the master doesn't see a hangup between
+    // clients, and make it raw like a serial port
+    slave = open(name, O_RDWR | O_NOCTTY);
+    if (slave < 0 || tcgetattr(slave, &tio) != 0) {
+        perror(name);
+        return 1;
+    }
+    cfmakeraw(&tio);
+    tcsetattr(slave, TCSANOW, &tio);
+
+    if (link) {
+        unlink(link);
+        if (symlink(name, link) != 0) {
+            perror(link);
+            return 1;
+        }
+    }
+    printf("%s\n", name);
+    fflush(stdout);
+
+    for (i = 1; i <= count; i++) {
+        sim_add_instr(i, &timing);
+    }
+    wall_start = wall_ns();
+    firmware_main();
+    return 0;
+}
@@ -0,0 +1,748 @@
+/*
+* GPIBUSB Adapter
+* sim.c
+**
+* © 2013-2014 Steven Casagrande (scasagrande@galvant.ca).
+*
+* This file is a part of the GPIBUSB Adapter project.
+* Licensed under the AGPL version 3.
+**
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU Affero General Public License for more details.
+*
+* You should have received a copy of the GNU Affero General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+**
+*
+* Host implementation of the CCS built-ins declared in ccs_host.h, backed
+* by a simulated GPIB bus, UART, timers and EEPROM. See sim.h.
+*/
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ccs_host.h"
+#include "sim.h"
+#include "../../usb_to_gpib.h"
+
+// Cost of each kind of hardware access, in instruction cycles
+#define COST_PIN 1
+#define COST_INPUT 2
+#define COST_IDLE 4 // One pass of an empty wait loop
+#define COST_ISR 40 // Context save and restore around an interrupt
+#define COST_EEPROM_READ 4
+
+#define EEPROM_WRITE_NS 4000000
+#define TICK1_NS 1736 // Timer1, internal clock / 8
+#define TICK2_NS 1000000 // Timer2 interrupt, 1ms
+#define FOSC 18432000
+#define TX_SLOTS 8
+
+// Firmware interrupt handlers
+void clock_isr(void);
+int RDA_isr();
+int TBE_isr();
+int EEPROM_isr();
+
+sim_ns sim_now;
+long sim_block_size = 1000000;
+void (*sim_bus_byte)(unsigned char data, int atn, int eoi);
+unsigned char SPBRG = 9, SPBRGH, BRG16 = 1, BRGH = 1;
+
+// Acceptor states
+enum { A_IDLE, A_NOT_READY, A_READY, A_ACCEPTING, A_ACCEPTED };
+// Source states
+enum { S_IDLE, S_WAIT_READY, S_SETTLE, S_WAIT_ACCEPT };
+// Replies
+enum { OUT_NONE, OUT_TEXT, OUT_BLOCK, OUT_DATA };
+
+struct instr {
+    int address;
+    struct instr_timing t;
+    int listen, talk, spe, spoll_sent, rqs;
+    // Lines this instrument pulls low
+    int nrfd, ndac, dav, eoi, srq;
+    unsigned char data;
+    int a_state;
+    sim_ns a_at;
+    unsigned char in[256];
+    int in_len;
+    uint64_t data_in;
+    int s_state;
+    sim_ns s_at;
+    int out_kind;
+    long out_len, out_pos;
+    sim_ns out_at;
+    char out_text[64];
+    const unsigned char *out_data;
+    unsigned char s_byte;
+};
+
+static struct instr instrs[SIM_MAX_INSTR];
+static int instr_count;
+
+static int adapter_low[SIM_PINS];
+static int irq_enabled[INT_EEPROM + 1];
+static int irq_flag[INT_EEPROM + 1];
+static int in_isr;
+
+static unsigned char eeprom[256];
+static sim_ns eeprom_done;
+static int eeprom_busy;
+
+static sim_ns next_tick2;
+static sim_ns timer1_wraps;
+
+// PC to adapter
+static unsigned char *host_q;
+static size_t host_q_len, host_q_pos, host_q_size;
+static sim_ns rx_next;
+static int rx_busy;
+static unsigned char rx_reg;
+static uint64_t overruns;
+
+// Adapter to PC, bytes in the transmit shift register and TXREG
+static struct { sim_ns done; unsigned char c; } tx_slot[TX_SLOTS];
+static int tx_head, tx_count;
+static sim_ns tx_free;
+
+static void step(void);
+
+static void advance(int cycles)
+{
+    sim_now += (sim_ns)cycles * SIM_CYCLE_NS;
+    step();
+}
+
+sim_ns sim_byte_ns(void)
+{
+    // 10 bits per byte at the rate set in SPBRG
+    unsigned long divisor;
+    if (BRG16 && BRGH) {
+        divisor = 4;
+    } else if (BRG16 || BRGH) {
+        divisor = 16;
+    } else {
+        divisor = 64;
+    }
+    divisor *= ((unsigned long)SPBRGH << 8 | SPBRG) + 1;
+    return (sim_ns)(10.0e9 * divisor / FOSC);
+}
+
+uint64_t sim_overruns(void)
+{
+    return overruns;
+}
+
+/*
+* Bus lines. A line is low if the adapter or any instrument pulls it low;
+* the data lines are low for 1 bits, as GPIB uses negative logic.
+*/
+static int line_low(int pin)
+{
+    int i;
+    if (adapter_low[pin]) {
+        return 1;
+    }
+    for (i = 0; i < instr_count; i++) {
+        struct instr *d = &instrs[i];
+        switch (pin) {
+        case EOI: if (d->eoi) return 1; break;
+        case DAV: if (d->dav) return 1; break;
+        case NRFD: if (d->nrfd) return 1; break;
+        case NDAC: if (d->ndac) return 1; break;
+        case SRQ: if (d->srq) return 1; break;
+        default:
+            if (pin >= PIN_B0 && pin <= PIN_B7 && ((d->data >> (pin - PIN_B0)) & 1)) {
+                return 1;
+            }
+            break;
+        }
+    }
+    return 0;
+}
+
+static unsigned char bus_data(void)
+{
+    unsigned char v = 0;
+    int i;
+    for (i = 0; i < 8; i++) {
+        if (line_low(PIN_B0 + i)) {
+            v |= 1 << i;
+        }
+    }
+    return v;
+}
+
+static unsigned char out_byte(struct instr *d, long pos)
+{
+    char header[16];
+    int header_len;
+    if (d->out_kind == OUT_TEXT) {
+        return d->out_text[pos];
+    }
+    if (d->out_kind == OUT_DATA) {
+        return d->out_data[pos];
+    }
+    header_len = sprintf(header, "#%d%ld", (int)snprintf(NULL, 0, "%ld", sim_block_size), sim_block_size);
+    if (pos < header_len) {
+        return header[pos];
+    }
+    pos -= header_len;
+    if (pos < sim_block_size) {
+        // Printable, as a 0x00 is taken for the EOS by ++eos 3
+        return 0x20 + pos % 95;
+    }
+    return '\n';
+}
+
+static void reply_text(struct instr *d, const char *text)
+{
+    d->out_kind = OUT_TEXT;
+    snprintf(d->out_text, sizeof(d->out_text), "%s", text);
+    d->out_len = strlen(d->out_text);
+    d->out_pos = 0;
+    d->out_at = sim_now + d->t.response;
+}
+
+static void message(struct instr *d)
+{
+    // A complete program message has arrived
+    char text[257];
+    char reply[64];
+    memcpy(text, d->in, d->in_len);
+    text[d->in_len] = 0;
+    d->in_len = 0;
+    if (strstr(text, "DATA?")) {
+        d->out_kind = OUT_BLOCK;
+        d->out_len = snprintf(NULL, 0, "#%d%ld", (int)snprintf(NULL, 0, "%ld", sim_block_size), sim_block_size)
+            + sim_block_size + 1;
+        d->out_pos = 0;
+        d->out_at = sim_now + d->t.response;
+    } else if (strstr(text, "*IDN?")) {
+        snprintf(reply, sizeof(reply), "SIMULATED,INSTRUMENT,%d,1.0\n", d->address);
+        reply_text(d, reply);
+    } else if (strstr(text, "MEAS?")) {
+        reply_text(d, "+1.234567E-03\n");
+    } else if (strchr(text, '?')) {
+        reply_text(d, "0\n");
+    }
+}
+
+static void accept_byte(struct instr *d, unsigned char b, int atn, int eoi)
+{
+    if (atn) {
+        b &= 0x7f;
+        if (b == CMD_UNL) {
+            d->listen = 0;
+        } else if (b == CMD_UNT) {
+            d->talk = 0;
+        } else if (b >= 0x20 && b < 0x3f) {
+            if ((b & 0x1f) == d->address) d->listen = 1;
+        } else if (b >= 0x40 && b < 0x5f) {
+            d->talk = (b & 0x1f) == d->address;
+            d->spoll_sent = 0;
+        } else if (b == CMD_SPE) {
+            d->spe = 1;
+        } else if (b == CMD_SPD) {
+            d->spe = 0;
+        } else if (b == CMD_DCL || (b == CMD_SDC && d->listen)) {
+            d->in_len = 0;
+            d->out_kind = OUT_NONE;
+        }
+        return;
+    }
+    if (!d->listen) {
+        return;
+    }
+    d->data_in++;
+    if (d->in_len < (int)sizeof(d->in)) {
+        d->in[d->in_len++] = b;
+    }
+    if (eoi || b == '\n') {
+        message(d);
+    }
+}
+
+static void acceptor(struct instr *d, int atn)
+{
+    if (!atn && !d->listen) {
+        d->nrfd = d->ndac = 0;
+        d->a_state = A_IDLE;
+        return;
+    }
+    switch (d->a_state) {
+    case A_IDLE:
+        d->nrfd = d->ndac = 1;
+        d->a_state = A_NOT_READY;
+        d->a_at = sim_now + d->t.ready;
+        break;
+    case A_NOT_READY:
+        if (sim_now >= d->a_at && !line_low(DAV)) {
+            d->nrfd = 0;
+            d->a_state = A_READY;
+        }
+        break;
+    case A_READY:
+        if (line_low(DAV)) {
+            d->nrfd = 1;
+            d->a_state = A_ACCEPTING;
+            d->a_at = sim_now + d->t.accept;
+        }
+        break;
+    case A_ACCEPTING:
+        if (sim_now >= d->a_at) {
+            accept_byte(d, bus_data(), atn, line_low(EOI));
+            d->ndac = 0;
+            d->a_state = A_ACCEPTED;
+        }
+        break;
+    case A_ACCEPTED:
+        if (!line_low(DAV)) {
+            d->ndac = 1;
+            d->a_state = A_NOT_READY;
+            d->a_at = sim_now + d->t.ready;
+        }
+        break;
+    }
+}
+
+static void source(struct instr *d, int atn)
+{
+    int can_talk = d->talk && !atn;
+    if (can_talk && !d->spe) {
+        can_talk = d->out_kind != OUT_NONE && sim_now >= d->out_at;
+    } else if (can_talk) {
+        can_talk = !d->spoll_sent;
+    }
+    if (!can_talk && d->s_state != S_WAIT_ACCEPT) {
+        d->dav = d->eoi = 0;
+        d->data = 0;
+        d->s_state = S_IDLE;
+        return;
+    }
+    if (atn) {
+        // The controller has taken the bus back
+        d->dav = d->eoi = 0;
+        d->data = 0;
+        d->s_state = S_IDLE;
+        return;
+    }
+    switch (d->s_state) {
+    case S_IDLE:
+        d->s_state = S_WAIT_READY;
+        break;
+    case S_WAIT_READY:
+        if (!line_low(NRFD) && line_low(NDAC)) {
+            if (d->spe) {
+                d->s_byte = d->rqs ? 0x41 : 0x01;
+                d->eoi = 0;
+            } else {
+                d->s_byte = out_byte(d, d->out_pos);
+                d->eoi = d->out_pos == d->out_len - 1;
+            }
+            d->data = d->s_byte;
+            d->s_at = sim_now + d->t.settle;
+            d->s_state = S_SETTLE;
+        }
+        break;
+    case S_SETTLE:
+        if (sim_now >= d->s_at) {
+            d->dav = 1;
+            d->s_state = S_WAIT_ACCEPT;
+        }
+        break;
+    case S_WAIT_ACCEPT:
+        if (!line_low(NDAC)) {
+            d->dav = d->eoi = 0;
+            d->data = 0;
+            if (d->spe) {
+                d->spoll_sent = 1;
+                if (d->rqs) {
+                    d->rqs = 0;
+                    d->srq = 0;
+                }
+            } else if (++d->out_pos == d->out_len) {
+                d->out_kind = OUT_NONE;
+            }
+            d->s_state = S_IDLE;
+        }
+        break;
+    }
+}
+
+static void instr_step(void)
+{
+    static int dav_was;
+    int i, atn, ifc, dav;
+    atn = line_low(ATN);
+    ifc = line_low(IFC);
+    if (sim_bus_byte) {
+        dav = line_low(DAV);
+        if (dav && !dav_was) {
+            sim_bus_byte(bus_data(), atn, line_low(EOI));
+        }
+        dav_was = dav;
+    }
+    for (i = 0; i < instr_count; i++) {
+        struct instr *d = &instrs[i];
+        if (ifc) {
+            d->listen = d->talk = d->spe = 0;
+        }
+        source(d, atn);
+        acceptor(d, atn);
+    }
+}
+
+static int irq_ready(int which)
+{
+    return irq_enabled[GLOBAL] && irq_enabled[which] && irq_flag[which];
+}
+
+static void uart_step(void)
+{
+    // Deliver finished bytes to the PC
+    while (tx_count && tx_slot[tx_head].done <= sim_now) {
+        unsigned char c = tx_slot[tx_head].c;
+        tx_head = (tx_head + 1) % TX_SLOTS;
+        tx_count--;
+        host_rx(c);
+    }
+    // TXREG is free once at most one byte is still shifting out
+    irq_flag[INT_TBE] = tx_free <= sim_now + sim_byte_ns();
+
+    // Next byte from the PC, which only starts sending once the firmware
+    // listens. It is received once all of its bits have arrived.
+    if (rx_busy && sim_now >= rx_next) {
+        if (irq_flag[INT_RDA]) {
+            overruns++;
+        }
+        rx_reg = host_q[host_q_pos++];
+        irq_flag[INT_RDA] = 1;
+        rx_busy = 0;
+    }
+    if (!rx_busy && host_q_pos < host_q_len && irq_enabled[INT_RDA]) {
+        rx_busy = 1;
+        rx_next = sim_now + sim_byte_ns();
+    }
+}
+
+static void step(void)
+{
+    instr_step();
+    host_step();
+    uart_step();
+
+    if (sim_now >= next_tick2) {
+        next_tick2 += TICK2_NS;
+        irq_flag[INT_TIMER2] = 1;
+    }
+    if (sim_now / TICK1_NS >> 16 != timer1_wraps) {
+        timer1_wraps = sim_now / TICK1_NS >> 16;
+        irq_flag[INT_TIMER1] = 1;
+    }
+    if (eeprom_busy && sim_now >= eeprom_done) {
+        eeprom_busy = 0;
+        irq_flag[INT_EEPROM] = 1;
+    }
+
+    if (in_isr) {
+        return;
+    }
+    in_isr = 1;
+    for (;;) {
+        if (irq_ready(INT_TIMER2)) {
+            irq_flag[INT_TIMER2] = 0;
+            clock_isr();
+        } else if (irq_ready(INT_RDA)) {
+            RDA_isr(); // Clears the flag by reading the byte
+        } else if (irq_ready(INT_TBE)) {
+            TBE_isr();
+            uart_step();
+        } else if (irq_ready(INT_EEPROM)) {
+            irq_flag[INT_EEPROM] = 0;
+            EEPROM_isr();
+        } else {
+            break;
+        }
+        sim_now += (sim_ns)COST_ISR * SIM_CYCLE_NS;
+        instr_step();
+        uart_step();
+    }
+    in_isr = 0;
+}
+
+void sim_add_instr(int address, const struct instr_timing *timing)
+{
+    struct instr *d = &instrs[instr_count++];
+    memset(d, 0, sizeof(*d));
+    d->address = address;
+    d->t = *timing;
+}
+
+static struct instr *find_instr(int address)
+{
+    int i;
+    for (i = 0; i < instr_count; i++) {
+        if (instrs[i].address == address) {
+            return &instrs[i];
+        }
+    }
+    return NULL;
+}
+
+void sim_instr_srq(int address)
+{
+    struct instr *d = find_instr(address);
+    if (d) {
+        d->rqs = d->srq = 1;
+    }
+}
+
+int sim_instr_rqs(int address)
+{
+    struct instr *d = find_instr(address);
+    return d && d->rqs;
+}
+
+void sim_instr_reply(int address, const unsigned char *data, long length)
+{
+    struct instr *d = find_instr(address);
+    if (d && length > 0) {
+        d->out_kind = OUT_DATA;
+        d->out_data = data;
+        d->out_len = length;
+        d->out_pos = 0;
+        d->out_at = sim_now + d->t.response;
+    }
+}
+
+uint64_t sim_instr_data_in(int address)
+{
+    struct instr *d = find_instr(address);
+    return d ? d->data_in : 0;
+}
+
+void sim_host_send(const void *data, size_t length)
+{
+    if (host_q_pos == host_q_len) {
+        host_q_pos = host_q_len = 0;
+    }
+    if (host_q_len + length > host_q_size) {
+        host_q_size = (host_q_len + length) * 2;
+        host_q = realloc(host_q, host_q_size);
+        if (!host_q) {
+            perror("realloc");
+            exit(2);
+        }
+    }
+    memcpy(host_q + host_q_len, data, length);
+    host_q_len += length;
+}
+
+size_t sim_host_queued(void)
+{
+    return host_q_len - host_q_pos;
+}
+
+// CCS built-ins
+
+void output_low(int pin)
+{
+    adapter_low[pin] = 1;
+    advance(COST_PIN);
+}
+
+void output_high(int pin)
+{
+    adapter_low[pin] = 0;
+    advance(COST_PIN);
+}
+
+void output_float(int pin)
+{
+    adapter_low[pin] = 0;
+    advance(COST_PIN);
+}
+
+int input(int pin)
+{
+    advance(COST_INPUT);
+    return !line_low(pin);
+}
+
+void output_b(int value)
+{
+    int i;
+    for (i = 0; i < 8; i++) {
+        adapter_low[PIN_B0 + i] = !((value >> i) & 1);
+    }
+    advance(COST_PIN);
+}
+
+int input_b(void)
+{
+    advance(COST_PIN);
+    return (unsigned char)~bus_data();
+}
+
+void delay_us(unsigned int us)
+{
+    while (us--) {
+        sim_now += 1000;
+        step();
+    }
+}
+
+void delay_ms(unsigned int ms)
+{
+    while (ms--) {
+        delay_us(1000);
+    }
+}
+
+void delay_cycles(unsigned int cycles)
+{
+    advance(cycles);
+}
+
+void restart_wdt(void)
+{
+    advance(COST_PIN);
+}
+
+void setup_wdt(int mode)
+{
+    (void)mode;
+}
+
+void set_rtcc(int value)
+{
+    (void)value;
+}
+
+void setup_timer_2(int mode, int period, int postscale)
+{
+    (void)mode; (void)period; (void)postscale;
+    next_tick2 = sim_now + TICK2_NS;
+}
+
+void setup_timer_1(int mode)
+{
+    (void)mode;
+}
+
+unsigned int get_timer1(void)
+{
+    advance(COST_INPUT);
+    return (unsigned int)((sim_now / TICK1_NS) & 0xffff);
+}
+
+void enable_interrupts(int which)
+{
+    irq_enabled[which] = 1;
+    advance(COST_PIN);
+}
+
+void disable_interrupts(int which)
+{
+    irq_enabled[which] = 0;
+    advance(COST_PIN);
+}
+
+void clear_interrupt(int which)
+{
+    irq_flag[which] = 0;
+}
+
+int interrupt_active(int which)
+{
+    return irq_flag[which];
+}
+
+int restart_cause(void)
+{
+    return NORMAL_POWER_UP;
+}
+
+void reset_cpu(void)
+{
+    fprintf(stderr, "sim: firmware reset itself at %.6fs\n", sim_now / 1e9);
+    exit(3);
+}
+
+int read_eeprom(int address)
+{
+    advance(COST_EEPROM_READ);
+    return eeprom[address & 0xff];
+}
+
+void write_eeprom(int address, int value)
+{
+    // WRITE_EEPROM=ASYNC: start the write and return
+    eeprom[address & 0xff] = value;
+    eeprom_busy = 1;
+    eeprom_done = sim_now + EEPROM_WRITE_NS;
+    advance(COST_PIN);
+}
+
+int sim_getc(void)
+{
+    irq_flag[INT_RDA] = 0;
+    return rx_reg;
+}
+
+void sim_putc(int c)
+{
+    // Only called from TBE_isr, so TXREG is known to be free
+    sim_ns start = tx_free > sim_now ? tx_free : sim_now;
+    int slot = (tx_head + tx_count) % TX_SLOTS;
+    tx_free = start + sim_byte_ns();
+    tx_slot[slot].done = tx_free;
+    tx_slot[slot].c = c;
+    tx_count++;
+    irq_flag[INT_TBE] = 0;
+    advance(COST_PIN);
+}
+
+int sim_trmt(void)
+{
+    advance(COST_PIN);
+    return tx_free <= sim_now;
+}
+
+void sim_idle(void)
+{
+    advance(COST_IDLE);
+}
+
+void tx_put(char c);
+
+int sim_printf(const char *format, ...)
+{
+    // printf(tx_put, ...) in the firmware
+    char text[256];
+    va_list args;
+    int n, i;
+    va_start(args, format);
+    n = vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    for (i = 0; i < n && i < (int)sizeof(text) - 1; i++) {
+        tx_put(text[i]);
+    }
+    return n;
+}
+
+__attribute__((constructor)) static void sim_init(void)
+{
+    memset(eeprom, 0xff, sizeof(eeprom));
+}
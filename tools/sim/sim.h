@@ -0,0 +1,81 @@
+/*
+* GPIBUSB Adapter
+* sim.h
+**
+* © 2013-2014 Steven Casagrande (scasagrande@galvant.ca).
+*
+* This file is a part of the GPIBUSB Adapter project.
+* Licensed under the AGPL version 3.
+**
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU Affero General Public License for more details.
+*
+* You should have received a copy of the GNU Affero General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+**
+*
+* Simulated adapter hardware for running the firmware on the host: a
+* virtual clock, the GPIB bus with a rack of simulated instruments, the
+* UART to the PC, Timer1/Timer2 and the EEPROM. The firmware is the only
+* thread; the bus and the PC side are stepped every time the firmware
+* touches the hardware, and time advances by a fixed number of PIC
+* instruction cycles per access.
+*/
+
+#ifndef SIM_H
+#define SIM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SIM_CYCLE_NS 217 // One instruction cycle, 4 clocks at 18.432MHz
+#define SIM_MAX_INSTR 8
+
+typedef uint64_t sim_ns;
+
+extern sim_ns sim_now;
+
+// Handshake timing of a simulated instrument, all in ns
+struct instr_timing {
+    sim_ns ready; // Acceptor: DAV high to NRFD released
+    sim_ns accept; // Acceptor: DAV low to NDAC released
+    sim_ns settle; // Source: data valid to DAV asserted
+    sim_ns response; // Message received to reply ready to talk
+};
+
+void sim_add_instr(int address, const struct instr_timing *timing);
+void sim_instr_srq(int address); // Request service from the controller
+int sim_instr_rqs(int address); // Still waiting to be polled
+uint64_t sim_instr_data_in(int address); // Data bytes accepted so far
+// Talk length bytes of data (EOI on the last) when next addressed, in
+// place of the reply to the last message. data must stay valid until sent.
+void sim_instr_reply(int address, const unsigned char *data, long length);
+extern long sim_block_size; // Payload of the DATA? reply
+
+// PC side, implemented by the program using the simulator
+void host_step(void);
+void host_rx(unsigned char c);
+
+// PC to adapter bytes are sent at the UART rate once the firmware has
+// enabled its receive interrupt
+void sim_host_send(const void *data, size_t length);
+size_t sim_host_queued(void);
+sim_ns sim_byte_ns(void);
+
+uint64_t sim_overruns(void);
+
+// If set, called with each byte as DAV is asserted, which is when a bus
+// monitor such as ++lon takes its timestamp
+extern void (*sim_bus_byte)(unsigned char data, int atn, int eoi);
+
+// The firmware's main(), renamed when it is compiled for the host
+void firmware_main(void);
+
+#endif
@@ -0,0 +1,68 @@
+#
+# GPIBUSB Adapter
+# fakeport.py
+#
+# Shared code for the gpibfake tests: start the firmware on a pty, write
+# host bytes to it and collect what it sends back. Each test_*.py file
+# runs its test_ functions with run() and exits non-zero on a failure.
+#
+
+import os
+import select
+import subprocess
+import sys
+import time
+
+TOOLS = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+
+class Fake(object):
+    def __init__(self, *args):
+        self.proc = subprocess.Popen([os.path.join(TOOLS, "gpibfake")] + list(args),
+                                     stdout=subprocess.PIPE)
+        name = self.proc.stdout.readline().decode().strip()
+        self.fd = os.open(name, os.O_RDWR | os.O_NOCTTY)
+
+    def close(self):
+        self.proc.kill()
+        self.proc.wait()
+        os.close(self.fd)
+
+    def send(self, data):
+        os.write(self.fd, data)
+
+    def read(self, seconds, count=None):
+        # Everything that arrives within seconds, or the first count bytes
+        out = b""
+        end = time.time() + seconds
+        while time.time() < end and (count is None or len(out) < count):
+            ready, _, _ = select.select([self.fd], [], [], 0.005)
+            if ready:
+                out += os.read(self.fd, 65536)
+        return out
+
+    def query(self, data, seconds=0.3, count=None):
+        self.send(data)
+        return self.read(seconds, count)
+
+
+def expect(what, got, want):
+    if got != want:
+        raise AssertionError("%s: got %r, want %r" % (what, got, want))
+
+
+def run(tests):
+    failed = 0
+    for name in sorted(tests):
+        if not name.startswith("test_"):
+            continue
+        fake = Fake()
+        try:
+            tests[name](fake)
+            print("ok   %s" % name)
+        except AssertionError as e:
+            print("FAIL %s: %s" % (name, e))
+            failed += 1
+        finally:
+            fake.close()
+    sys.exit(1 if failed else 0)
@@ -0,0 +1,45 @@
+#
+# ++abort in controller mode, and the main loop taking host input while a
+# read is in progress. Run with make check.
+#
+
+import time
+
+from fakeport import expect, run
+
+
+def setup(fake):
+    # Address 5 has no instrument, so reads from it only end by timeout
+    expect("setup", fake.query(b"++frame 1\n++read_tmo_ms 5000\n++addr 5\n++auto 0\n"), b"")
+
+
+def test_abort_stuck_read(fake):
+    setup(fake)
+    fake.send(b"++read eoi\n")
+    time.sleep(0.2)
+    start = time.time()
+    expect("abort frame", fake.query(b"++abort\n", 2, 3), b"\x00\x01\x03")
+    if time.time() - start > 0.5:
+        raise AssertionError("++abort took %.2fs" % (time.time() - start))
+
+
+def test_abort_queued_behind_read(fake):
+    setup(fake)
+    start = time.time()
+    got = fake.query(b"++read eoi\n++abort\n++addr\n", 2, 7)
+    expect("abort then ++addr", got, b"\x00\x01\x03\x01\x01\x005")
+    if time.time() - start > 1:
+        raise AssertionError("queued ++abort took %.2fs" % (time.time() - start))
+
+
+def test_packet_after_abort(fake):
+    setup(fake)
+    fake.send(b"++read eoi\n")
+    time.sleep(0.2)
+    expect("abort frame", fake.query(b"++abort\n++addr 1\n", 0.5), b"\x00\x01\x03")
+    got = fake.query(b"\x02\x03\x06*IDN?\n", 0.5)
+    expect("packet ack and reply", got,
+           b"\x00\x04\x00\x1b\x03\x00SIMULATED,INSTRUMENT,1,1.0\n")
+
+
+run(globals())
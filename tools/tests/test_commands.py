@@ -0,0 +1,42 @@
+#
+# ++raw, ++ton, ++pack and per-address profiles. Run with make check.
+#
+
+import time
+
+from fakeport import expect, run
+
+
+def test_version(fake):
+    expect("++ver", fake.query(b"++ver\n"), b"Version 6.0\r")
+
+
+def test_raw(fake):
+    fake.send(b"++addr 1\n++raw\n")
+    time.sleep(0.1)
+    idn = b"SIMULATED,INSTRUMENT,1,1.0\n"
+    expect("DLE EOT", fake.query(b"*IDN?\n\x10\x04"), idn)
+    expect("no end of message", fake.query(b"*IDN?\n"), b"")
+    expect("late DLE EOT", fake.query(b"\x10\x04"), idn)
+    expect("DLE ETX", fake.query(b"\x10\x03++addr\n"), b"1\r")
+
+
+def test_talk_only_readdress(fake):
+    got = fake.query(b"++read_tmo_ms 200\n++auto 0\n++addr 1\n++ton 1\nFOO\n"
+                     b"++addr 2\n*IDN?\n++ton 0\n++read eoi\n", 0.6)
+    expect("++ton then ++addr 2", got, b"SIMULATED,INSTRUMENT,2,1.0\n\r")
+
+
+def test_pack(fake):
+    got = fake.query(b"++read_tmo_ms 100\n++pack 1\n++addr 5\n++read eoi\n", 0.5)
+    expect("timeout", got, b"\x00\x09\x01")
+    expect("MEAS?", fake.query(b"++addr 1\nMEAS?\n", 0.5), b"\x04\x0b\x00\x3a\xa1\xd1\x32")
+
+
+def test_profiles(fake):
+    got = fake.query(b"++addr 1\n++read_tmo_ms 70000\n++profile 1\n++addr 2\n"
+                     b"++read_tmo_ms 500\n++profile 1\n++addr 1\n++read_tmo_ms\n", 0.5)
+    expect("timeout of address 1", got, b"70000\r")
+
+
+run(globals())
@@ -0,0 +1,28 @@
+#
+# Device mode without a controller on the bus: host data held for the
+# controller must not keep commands out for good. Run with make check.
+#
+
+from fakeport import expect, run
+
+
+def test_held_line_times_out(fake):
+    expect("held line", fake.query(b"++mode 0\nhello\n++ver\n", 2, 13),
+           b"\x06Version 6.0\r")
+
+
+def test_held_packet_times_out(fake):
+    expect("held packet", fake.query(b"++mode 0\n\x02\x01\x03abc++ver\n", 2, 13),
+           b"\x06Version 6.0\r")
+
+
+def test_back_to_controller(fake):
+    expect("mode", fake.query(b"++mode 0\nhello\n++mode 1\n++mode\n", 2, 3), b"\x061\r")
+
+
+def test_abort_in_device_mode(fake):
+    got = fake.query(b"++mode 0\n++abort\n++mode 1\n++addr 1\n++auto 1\n*IDN?\n", 1)
+    expect("query after ++abort", got, b"SIMULATED,INSTRUMENT,1,1.0\n\r")
+
+
+run(globals())
@@ -0,0 +1,50 @@
+#
+# ++prefetch: which host lines take the prefetched response, and that
+# a write nothing answers doesn't hold up the next command. Run with
+# make check.
+#
+
+import time
+
+from fakeport import expect, run
+
+IDN = b"\x1b\x03\x00SIMULATED,INSTRUMENT,1,1.0\n"
+
+
+def setup(fake):
+    fake.query(b"++frame 1\n++read_tmo_ms 1000\n++addr 1\n++auto 0\n++prefetch 1\n")
+
+
+def test_read_takes_prefetch(fake):
+    setup(fake)
+    fake.send(b"*IDN?\n")
+    time.sleep(0.1)
+    expect("++read eoi", fake.query(b"++read eoi\n", 0.5, len(IDN)), IDN)
+    fake.send(b"*IDN?\n")
+    time.sleep(0.1)
+    expect("+read", fake.query(b"+read\n", 0.5, len(IDN)), IDN)
+
+
+def test_split_read_line(fake):
+    setup(fake)
+    fake.send(b"*IDN?\n++re")
+    time.sleep(0.1)
+    expect("++read in two parts", fake.query(b"ad eoi\n", 0.5, len(IDN)), IDN)
+
+
+def test_other_line_drops_prefetch(fake):
+    setup(fake)
+    fake.send(b"*IDN?\n")
+    time.sleep(0.1)
+    expect("++addr", fake.query(b"++addr\n", 0.3), b"\x01\x01\x001")
+
+
+def test_silent_write_does_not_block(fake):
+    setup(fake)
+    start = time.time()
+    expect("++ver", fake.query(b"*RST\n++ver\n", 1, 14), b"\x0b\x01\x00Version 6.0")
+    if time.time() - start > 0.1:
+        raise AssertionError("++ver after *RST took %.3fs" % (time.time() - start))
+
+
+run(globals())
@@ -26,22 +26,53 @@
 */
 
 #include <18F4520.h>
+#device WRITE_EEPROM=ASYNC
 #fuses HS, NOPROTECT, NOLVP, WDT, WDT4096
 #use delay(clock=18432000)
 #use rs232(baud=460800,uart1)
 
+#byte SPBRG = getenv("SFR:SPBRG")
+#byte SPBRGH = getenv("SFR:SPBRGH")
+#bit BRG16 = getenv("BIT:BRG16")
+#bit BRGH = getenv("BIT:BRGH")
+#bit TRMT = getenv("BIT:TRMT")
+
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <ieeefloat.c>
 #include "usb_to_gpib.h"
 
-const unsigned int version = 5;
+const unsigned int version = 6;
 
 const unsigned int buf_size = 235;
-char cmd_buf[10], buf[buf_size+20];
-unsigned int buf_out = 0;
+char cmd_buf[10];
 unsigned int buf_in = 0;
 
+/*
+* The three 256 byte buffers each take a whole bank of RAM, so their 8 bit
+* indices wrap on their own and every access uses the same bank select.
+* rx_buf is the input ring filled by RDA_isr, tx_buf the output ring
+* emptied by TBE_isr, and read_buf collects bytes read from the bus until
+* they are passed on to the host.
+*
+* The 18F4520 only has 1536 bytes, so read_buf is also buf, the host line
+* being parsed. host_poll() leaves input in rx_buf for as long as a read
+* owns the bank, see there.
+*/
+char rx_buf[256];
+#locate rx_buf = 0x100
+char tx_buf[256];
+#locate tx_buf = 0x200
+char read_buf[256];
+#locate read_buf = 0x300
+#define buf read_buf
+unsigned int8 rx_in = 0;
+unsigned int8 rx_out = 0;
+unsigned int8 tx_in = 0;
+unsigned int8 tx_out = 0;
+const unsigned int read_chunk_size = 255; // Largest frame payload
+
 int partnerAddress = 1;
 int myAddress;
 
@@ -57,24 +88,235 @@ char autoread = 1;
 char eot_enable = 1;
 char eot_char = 13; // default CR
 char listen_only = 0;
+char talk_only = 0;
+char hs488 = 0; // HS488 cable length in meters, 0 for interlocked only
+char hs488_state = 0; // One of the HS488_ values, for the current write
+char t1_profile = 0; // Data settling time before DAV, one of the T1_ values
+boolean write_atn = false; // The current write is of command bytes
+
+// Numeric packing of read responses (++pack), see pack_char()
+char pack = 0; // One of the PACK_ values
+char pack_scale = 0; // PACK_INT values are multiplied by 10^pack_scale
+char pack_buf[64]; // Packed values waiting to be sent, 4 bytes each
+unsigned int8 pack_len = 0;
+char pack_state = 0; // One of the PS_ values, for the current field
+boolean pack_neg = false;
+boolean pack_exp_neg = false;
+unsigned int8 pack_digits = 0;
+unsigned int32 pack_mant = 0;
+signed int8 pack_dexp = 0; // Decimal exponent from the digit positions
+unsigned int8 pack_exp = 0; // Exponent written after the E
 char mode = 1;
 char save_cfg = 1;
-unsigned int status_byte = 0;
+char blink = 1; // Blink the error LED at power up
+char framing = 0; // Send responses as length-prefixed frames
+char status_byte = 0;
+
+char reply_buf[24];
 
 unsigned int32 timeout = 1000;
 unsigned int32 seconds = 0;
 
+// Adaptive timeouts. latency_est holds the handshake latency of each
+// address in ms*8, learned from its transactions.
+char tmo_adapt = 0;
+unsigned int8 tmo_mult = 4;
+unsigned int16 tmo_floor = 50;
+unsigned int16 latency_est[31];
+const unsigned int16 latency_unknown = 0xFFFF;
+unsigned int32 active_timeout = 1000; // Limit used by the handshake waits
+unsigned int32 wait_max = 0; // Longest handshake wait since tmo_begin()
+
+// Host link speeds reachable from the 18.432MHz crystal, Fosc/(4*(n+1))
+const unsigned int32 baud_rates[5] = {115200, 230400, 460800, 921600, 1152000};
+const unsigned int baud_divisors[5] = {39, 19, 9, 4, 3};
+const unsigned int baud_count = 5;
+const unsigned int32 baud_confirm_ms = 1000;
+char baud_index = 2; // 460800, as set by #use rs232
+
+boolean stream_active = false; // Last binary packet had BIN_MORE set
+boolean ton_addressed = false; // Talker role is still held for ++ton
+boolean raw_talking = false; // ++raw holds the talker role
+const unsigned int raw_idle_ms = 50; // ++raw writes a held byte after this
+
+// Controller-mode read in progress, see read_step()
+boolean read_active = false;
+boolean read_eoi = false; // Read until EOI only, not the EOS condition
+boolean read_waiting = false; // Ready for a byte the talker hasn't sent yet
+unsigned int8 read_len = 0; // Bytes in read_buf not sent yet
+char read_flags = 0; // FRAME_ flags of the last chunk, once the read has ended
+char read_error = 0; // FRAME_ERR_* code the read ended with
+char prefetch = 0; // ++prefetch, read the response to every write
+boolean read_hold = false; // The read is a prefetch, kept until ++read
+char prefetch_eoi = 0xFF; // End condition of the host's last read, 0xFF if none yet
+
+// ++abort, spotted by RDA_isr as the line arrives
+const char abort_cmd[8] = "++abort";
+boolean abort_req = false; // End the current transfer
+boolean abort_watch = true; // Off in ++raw, where host bytes are bus data
+unsigned int8 abort_pos = 0; // Characters of the line matched, 0xFF if none
+unsigned int8 abort_skip = 0; // Binary packet bytes still to pass over
+boolean abort_hdr = false; // abort_skip is counting the packet header
+
 // Variables for device mode
 boolean device_talk = false;
 boolean device_listen = false;
 boolean device_srq = false;
+boolean dev_pending = false; // A line waits at the head of the ring to be talked
+boolean dev_bin_held = false; // A packet waits at the head of the ring
+boolean dev_expired = false; // The held packet timed out, discard it
+unsigned int32 dev_held_ms = 0; // How long the host data has been held
+
+// Variables for the listen-only bus monitor
+unsigned int16 trace_last = 0;
+unsigned int8 trace_wraps = 0;
 
 // EEPROM variables
-const char VALID_EEPROM_CODE = 0xAA;
+const char VALID_EEPROM_CODE = 0xAA; // Marks the pre-v5 layout at 0x00
+const char cfg_version = 1;
 
+/*
+* The configuration is saved as a 16 byte record into one of cfg_slots slots
+* starting at cfg_eeprom, moving on to the next slot on every save so the
+* cells wear evenly. A record is cfg_version, a sequence number, the
+* settings and a CRC-8 of the first 15 bytes. At startup the valid record
+* with the newest sequence number is used, so a save cut short by a reset
+* just leaves the previous one in place.
+*/
+const char cfg_eeprom = 0x80;
+const unsigned int cfg_slots = 8;
+const unsigned int cfg_size = 16;
+char cfg_slot = cfg_slots - 1; // Slot of the newest record
+char cfg_seq = 0;
+
+// Background EEPROM writer, fed one byte at a time by EEPROM_isr
+char ee_buf[cfg_size]; // Record being written
+char ee_addr = 0;
+unsigned int8 ee_len = 0;
+unsigned int8 ee_pos = 0;
+boolean ee_busy = false;
+boolean cfg_dirty = false; // ++savecfg is waiting for the writer
+unsigned int8 profile_dirty = 0; // Bit n: profile slot n is waiting
+
+// Per-address settings, applied whenever partnerAddress changes. Slot n is
+// kept in EEPROM at profile_eeprom + n*profile_stride as cfg_version, then
+// the fields in the same order as the struct, then a CRC-8 like the config.
+struct profile {
+    char address; // profile_free if the slot is unused
+    char eos_code;
+    char eos;
+    char eoiUse;
+    char autoread;
+    byte strip;
+    unsigned int32 timeout;
+};
+const unsigned int profile_count = 8;
+const char profile_free = 0xFF;
+const char profile_eeprom = 0x10;
+const unsigned int profile_stride = 12;
+struct profile profiles[profile_count];
+
+/*
+* Build profile. usb_to_gpib_controller.c, usb_to_gpib_device.c and
+* usb_to_gpib_debug.c pick their own set of these and then include this
+* file; building this file directly gives the full firmware.
+*   WITH_CONTROLLER  controller mode (++mode 1)
+*   WITH_DEVICE      device mode and the ++lon bus monitor (++mode 0)
+*   WITH_DEBUG_MSGS  error messages enabled with ++debug 1
+*   VERBOSE_DEBUG    trace messages from inside the bus routines
+*   WITH_HS_PROFILE  handshake timing per address, read with ++hsprof
+*/
+#ifndef BUILD_PROFILE
 #define WITH_TIMEOUT
 #define WITH_WDT
+#define WITH_CONTROLLER
+#define WITH_DEVICE
+#define WITH_DEBUG_MSGS
 //#define VERBOSE_DEBUG
+//#define WITH_HS_PROFILE
+#endif
+
+// With only one mode built in, the mode tests become constants and the
+// compiler drops the code for the other mode
+#if defined(WITH_CONTROLLER) && defined(WITH_DEVICE)
+#define CONTROLLER_MODE (mode)
+#elif defined(WITH_CONTROLLER)
+#define CONTROLLER_MODE 1
+#else
+#define CONTROLLER_MODE 0
+#endif
+
+#ifdef WITH_DEBUG_MSGS
+#define DEBUG_MSGS (debug == 1)
+#else
+#define DEBUG_MSGS 0
+#endif
+
+#define IFC_US 100 // Shortest IFC pulse allowed by IEEE-488.1
+
+// ++t1 settling profiles, see t1_settle()
+#define T1_NONE 0 // No added delay
+#define T1_2US 1 // Open collector drivers, the IEEE-488.1 default
+#define T1_1US1 2 // 1.1us
+#define T1_350NS 3 // Tri-state drivers on a short cable
+#define T1_AUTO 4 // 2us for commands, 1.1us with EOI, else 350ns
+#define T1_COUNT 5
+
+// ++pack formats
+#define PACK_OFF 0
+#define PACK_FLOAT 1 // IEEE-754 float32, big-endian
+#define PACK_INT 2 // Signed int32 of value*10^pack_scale, big-endian
+#define PACK_INVALID_FLOAT 0x7FC00000 // NaN, for fields that aren't numbers
+#define PACK_INVALID_INT 0x80000000
+
+// Number parser states
+#define PS_IDLE 0 // Nothing but spaces yet
+#define PS_SIGN 1 // After a leading + or -
+#define PS_INT 2 // Integer digits
+#define PS_FRAC 3 // Digits after the decimal point
+#define PS_EXP_SIGN 4 // Just after the E
+#define PS_EXP 5 // Exponent digits
+#define PS_TAIL 6 // After the number, e.g. units, ignored
+#define PS_BAD 7 // Not a number
+
+// HS488 write states, see gpib_write_byte()
+#define HS488_OFF 0 // Interlocked handshake for the rest of the write
+#define HS488_FIRST 1 // Next byte is the first one, always interlocked
+#define HS488_DETECT 2 // Next byte checks whether the listeners can do HS488
+#define HS488_ON 3 // Non-interlocked handshake
+
+#ifdef WITH_HS_PROFILE
+/*
+* Handshake profiler. Each wait for another device is timed with Timer1
+* (1.736us per tick) and added to the statistics of the partner address
+* and the phase it was waiting in. Only hs_slots addresses are tracked,
+* the first ones seen after ++hsprof 0.
+*/
+struct hs_stat {
+    unsigned int16 min;
+    unsigned int16 max;
+    unsigned int32 sum;
+    unsigned int16 count;
+    unsigned int8 hist[4]; // Under 7us, 111us, 1.8ms and longer
+};
+const unsigned int hs_slots = 4;
+const unsigned int hs_phases = 4;
+const char hs_none = 0xFF;
+const char hs_names[hs_phases][8] = {"ndac_lo", "nrfd_hi", "ndac_hi", "dav_lo"};
+char hs_address[hs_slots];
+struct hs_stat hs_stats[hs_slots * hs_phases];
+char hs_cur = 0xFF; // Slot timed waits are added to, or hs_none
+unsigned int16 hs_t0;
+#define HS_NDAC_LO 0 // Writing, NDAC low before the data lines are set
+#define HS_NRFD_HI 1 // Writing, NRFD high before DAV
+#define HS_NDAC_HI 2 // Writing, NDAC high after DAV
+#define HS_DAV_LO 3  // Reading, DAV low
+#define HS_START() hs_t0 = get_timer1()
+#define HS_STOP(phase) hs_record(phase)
+#else
+#define HS_START()
+#define HS_STOP(phase)
+#endif
 
 #int_timer2
 void clock_isr() {
@@ -82,39 +324,787 @@ void clock_isr() {
 }
 
 #int_rda
-RDA_isr()
+void RDA_isr()
+{
+    char c;
+    
+    c=getc();
+    if ((unsigned int8)(rx_in + 1) != rx_out) { // Drop the byte if full
+        rx_buf[rx_in++] = c;
+    }
+    
+    /*
+    * ++abort has to be seen while the main loop is still busy with the
+    * transfer it ends, so it is matched here as it arrives. Binary packets
+    * are passed over the same way host_poll() reads them.
+    */
+    if (abort_watch) {
+        if (abort_skip) {
+            --abort_skip;
+            if (abort_hdr && (abort_skip == 0)) {
+                abort_hdr = false;
+                abort_skip = c; // That was the length, the payload follows
+            }
+        }
+        else if ((c == 10) || (c == 13)) {
+            // In device mode the controller runs the transfers, and an
+            // abort would only fail device_atn() until the line is taken
+            if ((abort_pos == 7) && CONTROLLER_MODE) {
+                abort_req = true;
+            }
+            abort_pos = 0;
+        }
+        else if ((c == BIN_START) && (abort_pos == 0)) {
+            abort_skip = 2; // Flags and length
+            abort_hdr = true;
+        }
+        else if ((abort_pos < 7) && (c == abort_cmd[abort_pos])) {
+            ++abort_pos;
+        }
+        else {
+            abort_pos = 0xFF; // Some other line
+        }
+    }
+}
+
+#int_eeprom
+void EEPROM_isr()
 {
+    // The last byte is done, start on the next one
+    if (++ee_pos < ee_len) {
+        write_eeprom(ee_addr + ee_pos, ee_buf[ee_pos]);
+    }
+    else {
+        disable_interrupts(INT_EEPROM);
+        ee_busy = false;
+    }
+}
+
+#int_tbe
+void TBE_isr()
+{
+    if (tx_out != tx_in) {
+        putc(tx_buf[tx_out++]);
+    }
+    else {
+        disable_interrupts(INT_TBE); // Ring is empty
+    }
+}
+
+void tx_put(char c) {
+    /*
+    * Queue a byte for the host. Everything sent to the host goes through
+    * here (printf included, as printf(tx_put, ...)) so that it stays in
+    * order. Waits only while the ring is full.
+    */
+    while ((unsigned int8)(tx_in + 1) == tx_out) {}
+    tx_buf[tx_in++] = c;
+    enable_interrupts(INT_TBE);
+}
+
+void tx_drain(void) {
+    // Wait until everything queued has left the UART
+    while (tx_in != tx_out) {}
+    while(!TRMT) {}
+}
+
+boolean cmd_is(char *pnt, rom char *cmd) {
+    /*
+    * True if the text at pnt starts with cmd. The command names are kept
+    * in program memory so they don't take up RAM.
+    */
+    while (*cmd) {
+        if (*pnt != *cmd) {
+            return false;
+        }
+        ++pnt;
+        ++cmd;
+    }
+    return true;
+}
+
+char rx_get(void) {
+    /*
+    * Wait for the next byte from the host. This is only used part way 
+    * through a binary packet, so if the host never sends the rest the WDT
+    * will eventually reset the adapter.
+    */
     char c;
-    BOOLEAN add_null = false; 
+    while(rx_in == rx_out) {}
+    c = rx_buf[rx_out++];
+    return c;
+}
+
+void uart_set_baud(char index) {
+    // Switch the EUSART to baud_rates[index] once the last byte has gone out
+    tx_drain();
+    BRG16 = 1;
+    BRGH = 1;
+    SPBRGH = 0;
+    SPBRG = baud_divisors[index];
+}
+
+void set_eos(char code) {
+    /*
+    * Set the EOS characters from a ++eos code. Code 4 is a single custom
+    * character, already stored in eos by +eos:N.
+    */
+    eos_code = code;
+    switch (eos_code) {
+        case 0:
+            eos_string[0] = 13;
+            eos_string[1] = 10;
+            eos_string[2] = 0x00;
+            eos = 10;
+            break;
+        case 1:
+            eos_string[0] = 13;
+            eos_string[1] = 0x00;
+            eos = 13;
+            break;
+        case 2:
+            eos_string[0] = 10;
+            eos_string[1] = 0x00;
+            eos = 10;
+            break;
+        case 4:
+            eos_string[0] = eos;
+            eos_string[1] = 0x00;
+            break;
+        default:
+            eos_code = 3;
+            eos_string[0] = 0x00;
+            eos = 0;
+            break;
+    }
+}
+
+char profile_find(int address) {
+    // Slot holding the profile for address, or profile_count if none
+    char i;
+    for(i=0;i<profile_count;++i) {
+        if (profiles[i].address == address) {
+            break;
+        }
+    }
+    return i;
+}
+
+char crc8(char *data, unsigned int8 length) {
+    // CRC-8 with polynomial 0x07, as used for the EEPROM records
+    char crc = 0;
+    char i;
+    while (length--) {
+        crc ^= *data++;
+        for(i=0;i<8;++i) {
+            if (bit_test(crc, 7)) {
+                crc = (crc << 1) ^ 0x07;
+            }
+            else {
+                crc <<= 1;
+            }
+        }
+    }
+    return crc;
+}
+
+boolean ee_read_record(char base, unsigned int8 length) {
+    // Copy a record into ee_buf, returning true if its version and CRC match
+    unsigned int8 i;
+    for(i=0;i<length;++i) {
+        ee_buf[i] = read_eeprom(base + i);
+    }
+    return (ee_buf[0] == cfg_version) && (crc8(ee_buf, length-1) == ee_buf[length-1]);
+}
 
-    do {
-        c=getc();
-        if ((c>=32)&&(c<=126)) { // if human readable ascii char
-            buf[buf_in++] = c;
-            add_null = true;
+void cfg_pack(void) {
+    // Snapshot the settings saved by ++savecfg into ee_buf
+    memset(ee_buf, 0, cfg_size);
+    ee_buf[0] = cfg_version;
+    ee_buf[1] = cfg_seq;
+    ee_buf[2] = mode;
+    ee_buf[3] = partnerAddress;
+    ee_buf[4] = eot_char;
+    ee_buf[5] = eot_enable;
+    ee_buf[6] = eos_code;
+    ee_buf[7] = eos;
+    ee_buf[8] = eoiUse;
+    ee_buf[9] = autoread;
+    ee_buf[10] = listen_only;
+    ee_buf[11] = save_cfg;
+    ee_buf[12] = baud_index;
+    ee_buf[13] = blink;
+    ee_buf[14] = t1_profile;
+    ee_buf[cfg_size-1] = crc8(ee_buf, cfg_size-1);
+}
+
+boolean cfg_load(void) {
+    // Apply the newest valid config record, if there is one
+    char i, found;
+    found = cfg_slots;
+    for(i=0;i<cfg_slots;++i) {
+        if (ee_read_record(cfg_eeprom + (i * cfg_size), cfg_size)) {
+            // Sequence numbers wrap, so compare them by their difference
+            if ((found == cfg_slots) || ((signed int8)(ee_buf[1] - cfg_seq) > 0)) {
+                found = i;
+                cfg_seq = ee_buf[1];
+            }
         }
-    } while((c!=10)&&(c!=13)); //both LF and CR are now valid termination chars
+    }
+    if (found == cfg_slots) {
+        return false;
+    }
+    cfg_slot = found;
+    ee_read_record(cfg_eeprom + (found * cfg_size), cfg_size);
+    mode = ee_buf[2];
+    partnerAddress = ee_buf[3];
+    ton_addressed = false;
+    eot_char = ee_buf[4];
+    eot_enable = ee_buf[5];
+    eos = ee_buf[7];
+    set_eos(ee_buf[6]);
+    eoiUse = ee_buf[8];
+    autoread = ee_buf[9];
+    listen_only = ee_buf[10];
+    save_cfg = ee_buf[11];
+    baud_index = ee_buf[12];
+    blink = ee_buf[13];
+    t1_profile = ee_buf[14];
+    if (t1_profile >= T1_COUNT) {
+        t1_profile = T1_NONE;
+    }
+    return true;
+}
+
+void profile_pack(char i) {
+    memset(ee_buf, 0, profile_stride);
+    ee_buf[0] = cfg_version;
+    ee_buf[1] = profiles[i].address;
+    ee_buf[2] = profiles[i].eos_code;
+    ee_buf[3] = profiles[i].eos;
+    ee_buf[4] = profiles[i].eoiUse;
+    ee_buf[5] = profiles[i].autoread;
+    ee_buf[6] = profiles[i].strip;
+    ee_buf[7] = make8(profiles[i].timeout, 3);
+    ee_buf[8] = make8(profiles[i].timeout, 2);
+    ee_buf[9] = make8(profiles[i].timeout, 1);
+    ee_buf[10] = make8(profiles[i].timeout, 0);
+    ee_buf[profile_stride-1] = crc8(ee_buf, profile_stride-1);
+}
+
+void ee_poll(void) {
+    /*
+    * Start writing the next queued record, if the writer is idle. Each byte
+    * takes about 4ms, during which the main loop keeps running. Only
+    * EEPROM_isr writes while ee_busy is set, so the asynchronous
+    * write_eeprom calls never overlap.
+    */
+    char i;
+    if (ee_busy) {
+        return;
+    }
+    if (cfg_dirty) {
+        cfg_dirty = false;
+        cfg_slot = (cfg_slot + 1) % cfg_slots;
+        ++cfg_seq;
+        cfg_pack();
+        ee_addr = cfg_eeprom + (cfg_slot * cfg_size);
+        ee_len = cfg_size;
+    }
+    else if (profile_dirty) {
+        for(i=0;!bit_test(profile_dirty, i);++i) {}
+        bit_clear(profile_dirty, i);
+        profile_pack(i);
+        ee_addr = profile_eeprom + (i * profile_stride);
+        ee_len = profile_stride;
+    }
+    else {
+        return;
+    }
+    ee_pos = 0;
+    ee_busy = true;
+    write_eeprom(ee_addr, ee_buf[0]);
+    clear_interrupt(INT_EEPROM);
+    enable_interrupts(INT_EEPROM);
+}
+
+void profile_load(void) {
+    char i, base;
+    for(i=0;i<profile_count;++i) {
+        base = profile_eeprom + (i * profile_stride);
+        if (!ee_read_record(base, profile_stride) || (ee_buf[1] > 30)) {
+            profiles[i].address = profile_free; // Never written
+            continue;
+        }
+        profiles[i].address = ee_buf[1];
+        profiles[i].eos_code = ee_buf[2];
+        profiles[i].eos = ee_buf[3];
+        profiles[i].eoiUse = ee_buf[4];
+        profiles[i].autoread = ee_buf[5];
+        profiles[i].strip = ee_buf[6];
+        profiles[i].timeout = make32(ee_buf[7], ee_buf[8], ee_buf[9], ee_buf[10]);
+    }
+}
+
+char profile_save(int address) {
+    // Store the current settings as the profile for address
+    char i;
+    i = profile_find(address);
+    if (i == profile_count) {
+        i = profile_find(profile_free);
+        if (i == profile_count) {
+            return 1; // Table is full
+        }
+    }
+    profiles[i].address = address;
+    profiles[i].eos_code = eos_code;
+    profiles[i].eos = eos;
+    profiles[i].eoiUse = eoiUse;
+    profiles[i].autoread = autoread;
+    profiles[i].strip = strip;
+    profiles[i].timeout = timeout;
+    bit_set(profile_dirty, i);
+    return 0;
+}
+
+void profile_delete(int address) {
+    char i;
+    i = profile_find(address);
+    if (i != profile_count) {
+        profiles[i].address = profile_free;
+        bit_set(profile_dirty, i);
+    }
+}
+
+void set_partner(int address) {
+    // Change partnerAddress, switching to its profile if it has one
+    char i;
+    partnerAddress = address;
+    ton_addressed = false; // ++ton addressed the old partner to listen
+    i = profile_find(address);
+    if (i != profile_count) {
+        eos = profiles[i].eos;
+        set_eos(profiles[i].eos_code);
+        eoiUse = profiles[i].eoiUse;
+        autoread = profiles[i].autoread;
+        strip = profiles[i].strip;
+        timeout = profiles[i].timeout;
+    }
+}
+
+void frame_header(char length, char flags, char error) {
+    /*
+    * Header sent ahead of every response chunk when framing is enabled.
+    * length: number of payload bytes following this header
+    * flags: FRAME_END on the last chunk, FRAME_EOI if EOI ended the read
+    * error: one of the FRAME_ERR_* codes
+    */
+    tx_put(length);
+    tx_put(flags);
+    tx_put(error);
+}
+
+void frame_error(char error) {
+    // Close out a framed response that ended early
+    if (framing) {
+        frame_header(0, FRAME_END, error);
+    }
+}
+
+void send_chunk(char *pnt, char count, char flags, char error) {
+    // Write count bytes to the host, preceded by a frame header if enabled
+    char j;
+    if (framing) {
+        frame_header(count, flags, error);
+    }
+    for(j=0;j<count;++j){
+        tx_put(*pnt);
+        ++pnt;
+    }
+}
+
+void pack_flush(char flags) {
+    // Send the packed values as a frame, even if ++frame is off
+    char j;
+    frame_header(pack_len, flags | FRAME_PACKED, FRAME_ERR_NONE);
+    for(j=0;j<pack_len;++j){
+        tx_put(pack_buf[j]);
+    }
+    pack_len = 0;
+}
+
+void pack_reset(void) {
+    // Start a new field
+    pack_state = PS_IDLE;
+    pack_neg = false;
+    pack_exp_neg = false;
+    pack_digits = 0;
+    pack_mant = 0;
+    pack_dexp = 0;
+    pack_exp = 0;
+}
+
+void pack_field(void) {
+    // Convert the field parsed so far and add it to pack_buf
+    unsigned int32 value;
+    signed int16 e; // pack_dexp and pack_exp are both limited to 99
+    float f;
+    boolean valid;
     
-    while(kbhit()){
-        buf[buf_in] = getc();
+    if (pack_state == PS_IDLE) {
+        return; // Empty field, e.g. the LF of a CR LF
+    }
+    valid = (pack_digits != 0) && (pack_state != PS_BAD) && (pack_state != PS_EXP_SIGN);
+    e = pack_dexp;
+    if (pack_exp_neg) {
+        e -= pack_exp;
+    }
+    else {
+        e += pack_exp;
     }
-    if (add_null)
-        buf[buf_in++] = 0x00;
     
-	if (buf_in >= buf_size)
-	    buf_in = 0;
+    if (pack == PACK_FLOAT) {
+        value = PACK_INVALID_FLOAT;
+        if (valid) {
+            f = pack_mant;
+            for(;e>0;--e) {
+                f *= 10;
+            }
+            for(;e<0;++e) {
+                f /= 10;
+            }
+            if (pack_neg) {
+                f = -f;
+            }
+            value = f_PICtoIEEE(f);
+        }
+    }
+    else {
+        value = PACK_INVALID_INT;
+        if (valid) {
+            value = pack_mant;
+            e += pack_scale;
+            for(;e>0;--e) {
+                if (value > 214748364) {
+                    value = 0x7FFFFFFF; // Saturate
+                    break;
+                }
+                value *= 10;
+            }
+            for(;e<0;++e) {
+                if (e == -1) {
+                    value += 5; // Round the last digit dropped
+                }
+                value /= 10;
+            }
+            if (value > 0x7FFFFFFF) {
+                value = 0x7FFFFFFF;
+            }
+            if (pack_neg) {
+                value = -value;
+            }
+        }
+    }
+    
+    pack_buf[pack_len++] = make8(value, 3);
+    pack_buf[pack_len++] = make8(value, 2);
+    pack_buf[pack_len++] = make8(value, 1);
+    pack_buf[pack_len++] = make8(value, 0);
+    if (pack_len == sizeof(pack_buf)) {
+        pack_flush(0);
+    }
+    pack_reset();
 }
 
-char buf_get(char *pnt) {
-    pnt = &(buf[buf_out]);
-    buf_out += (strlen(&(buf[buf_out])) + 1);
-    if (buf_out >= buf_size)
-        buf_out = 0;
-    if (buf_out == buf_in) {
-        buf_out = 0;
-        buf_in = 0;
+void pack_digit(char c) {
+    // Add a mantissa digit, keeping at most 9 significant ones
+    if (pack_digits < 255) {
+        ++pack_digits;
+    }
+    if (pack_state != PS_FRAC) {
+        if (pack_mant < 100000000) {
+            pack_mant = (pack_mant * 10) + (c - '0');
+        }
+        else if (pack_dexp < 99) {
+            ++pack_dexp; // Saturates, far beyond what a float can hold anyway
+        }
+    }
+    else if ((pack_mant < 100000000) && (pack_dexp > -99)) {
+        pack_mant = (pack_mant * 10) + (c - '0');
+        --pack_dexp;
+    }
+    else if ((pack_mant == 0) && (c != '0')) {
+        pack_state = PS_BAD; // Below 1E-99, the same limit as pack_dexp
     }
-    return pnt;
+}
+
+void pack_char(char c) {
+    /*
+    * Parse one character of a response like "+1.234567E-03,-5.2E+00".
+    * Fields are separated by commas, semicolons, CR or LF. Anything after
+    * a number (units for example) is ignored, and a field that doesn't
+    * start with a number is sent as PACK_INVALID_FLOAT or PACK_INVALID_INT.
+    */
+    boolean digit;
+    if ((c == ',') || (c == ';') || (c == 13) || (c == 10)) {
+        pack_field();
+        return;
+    }
+    digit = (c >= '0') && (c <= '9');
+    switch (pack_state) {
+        case PS_IDLE:
+            if ((c == ' ') || (c == 9)) {
+                break;
+            }
+            if ((c == '+') || (c == '-')) {
+                pack_neg = (c == '-');
+                pack_state = PS_SIGN;
+                break;
+            }
+            // fall through
+        case PS_SIGN:
+            if (digit) {
+                pack_state = PS_INT;
+                pack_digit(c);
+            }
+            else if (c == '.') {
+                pack_state = PS_FRAC;
+            }
+            else {
+                pack_state = PS_BAD;
+            }
+            break;
+        case PS_INT:
+        case PS_FRAC:
+            if (digit) {
+                pack_digit(c);
+            }
+            else if ((c == '.') && (pack_state == PS_INT)) {
+                pack_state = PS_FRAC;
+            }
+            else if ((c == 'E') || (c == 'e')) {
+                pack_state = PS_EXP_SIGN;
+            }
+            else {
+                pack_state = PS_TAIL;
+            }
+            break;
+        case PS_EXP_SIGN:
+            if ((c == '+') || (c == '-')) {
+                pack_exp_neg = (c == '-');
+                pack_state = PS_EXP;
+                break;
+            }
+            // fall through
+        case PS_EXP:
+            if (digit) {
+                pack_state = PS_EXP;
+                if (pack_exp < 10) {
+                    pack_exp = (pack_exp * 10) + (c - '0');
+                }
+                else {
+                    pack_exp = 99; // Saturate before it can wrap
+                }
+            }
+            else if (pack_state == PS_EXP_SIGN) {
+                pack_state = PS_BAD;
+            }
+            else {
+                pack_state = PS_TAIL;
+            }
+            break;
+    }
+}
+
+void read_chunk(char *pnt, char count, char flags) {
+    // Pass a piece of a read response on to the host, packed if ++pack is on
+    char j;
+    if (pack == PACK_OFF) {
+        send_chunk(pnt, count, flags, FRAME_ERR_NONE);
+        return;
+    }
+    for(j=0;j<count;++j){
+        pack_char(*pnt);
+        ++pnt;
+    }
+    if (flags & FRAME_END) {
+        pack_field();
+        pack_flush(flags);
+    }
+}
+
+void send_reply(char *pnt, char count) {
+    // Send a complete adapter response, terminated by eot_char or a frame
+    send_chunk(pnt, count, FRAME_END, FRAME_ERR_NONE);
+    if (!framing) {
+        tx_put(eot_char);
+    }
+}
+
+void reply_int(unsigned int32 value) {
+    sprintf(reply_buf, "%Lu", value);
+    send_reply(reply_buf, strlen(reply_buf));
+}
+
+#ifdef WITH_HS_PROFILE
+void hs_clear(void) {
+    memset(hs_address, hs_none, hs_slots);
+    memset(hs_stats, 0, sizeof(hs_stats));
+}
+
+void hs_select(int address) {
+    // Add the following waits to the slot of address, claiming a free one
+    char i;
+    hs_cur = hs_none;
+    if (address > 30) {
+        return;
+    }
+    for(i=0;i<hs_slots;++i) {
+        if ((hs_address[i] == address) || (hs_address[i] == hs_none)) {
+            hs_address[i] = address;
+            hs_cur = i;
+            return;
+        }
+    }
+}
+
+void hs_record(char phase) {
+    unsigned int16 t;
+    struct hs_stat *st;
+    t = get_timer1() - hs_t0;
+    if (hs_cur == hs_none) {
+        return;
+    }
+    if (seconds >= 100) {
+        t = 0xFFFF; // Timer1 has wrapped, saturate
+    }
+    st = &hs_stats[(hs_cur * hs_phases) + phase];
+    if ((st->count == 0) || (t < st->min)) {
+        st->min = t;
+    }
+    if (t > st->max) {
+        st->max = t;
+    }
+    if (st->count != 0xFFFF) {
+        st->sum += t;
+        ++st->count;
+    }
+    if (t < 4) {
+        phase = 0;
+    }
+    else if (t < 64) {
+        phase = 1;
+    }
+    else if (t < 1024) {
+        phase = 2;
+    }
+    else {
+        phase = 3;
+    }
+    if (st->hist[phase] != 0xFF) {
+        ++st->hist[phase];
+    }
+}
+
+unsigned int32 hs_us(unsigned int32 ticks) {
+    return (ticks * 1736) / 1000;
+}
+
+void hs_dump(int address) {
+    /*
+    * Reply with one line per phase for address:
+    * name count min avg max (in us) and the four histogram counts
+    */
+    char line[64];
+    char i, j, k;
+    struct hs_stat *st;
+    for(i=0;i<hs_slots;++i) {
+        if (hs_address[i] == address) {
+            break;
+        }
+    }
+    if (i == hs_slots) {
+        strcpy(reply_buf, "none");
+        send_reply(reply_buf, 4);
+        return;
+    }
+    for(j=0;j<hs_phases;++j) {
+        st = &hs_stats[(i * hs_phases) + j];
+        for(k=0;hs_names[j][k] != 0;++k) {
+            line[k] = hs_names[j][k]; // In ROM, so no %s
+        }
+        sprintf(line + k, " %Lu %Lu %Lu %Lu %u %u %u %u",
+            (unsigned int32)st->count, hs_us(st->min),
+            st->count ? hs_us(st->sum / st->count) : 0, hs_us(st->max),
+            st->hist[0], st->hist[1], st->hist[2], st->hist[3]);
+        send_reply(line, strlen(line));
+    }
+}
+#endif
+
+void wait_end(void) {
+    // Finish a timed handshake wait, keeping track of the longest one
+    disable_interrupts(INT_TIMER2);
+    if (seconds > wait_max) {
+        wait_max = seconds;
+    }
+}
+
+unsigned int32 tmo_effective(int address) {
+    // Timeout to use with address: its estimate times tmo_mult, capped by
+    // the ++read_tmo_ms value
+    unsigned int32 t;
+    if (!tmo_adapt || (address > 30) || (latency_est[address] == latency_unknown)) {
+        return timeout;
+    }
+    t = ((unsigned int32)latency_est[address] * tmo_mult) >> 3;
+    if (t < tmo_floor) {
+        t = tmo_floor;
+    }
+    if (t > timeout) {
+        t = timeout;
+    }
+    return t;
+}
+
+void tmo_begin(int address) {
+    wait_max = 0;
+    active_timeout = tmo_effective(address);
+}
+
+void tmo_end(int address, char error) {
+    /*
+    * Fold the longest wait of a transaction into the estimate for address.
+    * Slower samples are taken on quickly, while faster ones only pull the
+    * estimate down slowly, so that quick writes don't shrink the timeout
+    * used for slow reads from the same instrument.
+    */
+    unsigned int32 est, sample;
+    active_timeout = timeout;
+    if (address > 30) {
+        return;
+    }
+    est = latency_est[address];
+    sample = wait_max << 3;
+    if (error) {
+        // Possibly timed out because the estimate was too short
+        if (est != latency_unknown) {
+            est = (est << 1) + 8;
+        }
+    }
+    else if (est == latency_unknown) {
+        est = sample;
+    }
+    else if (sample > est) {
+        est = (est + sample) >> 1;
+    }
+    else {
+        est = est - (est >> 4) + (sample >> 4);
+    }
+    if (est >= latency_unknown) {
+        est = latency_unknown - 1;
+    }
+    latency_est[address] = est;
 }
 
 // Puts all the GPIB pins into their correct initial states.
@@ -122,7 +1112,7 @@ void prep_gpib_pins() {
 	output_low(TE); // Disables talking on data and handshake lines
 	output_low(PE);
     
-    if (mode) {
+    if (CONTROLLER_MODE) {
 	    output_high(SC); // Allows transmit on REN and IFC
 	    output_low(DC); // Transmit ATN and receive SRQ
 	}
@@ -140,7 +1130,7 @@ void prep_gpib_pins() {
 	output_float(DIO7);
 	output_float(DIO8);
 	
-	if (mode) {
+	if (CONTROLLER_MODE) {
 	    output_high(ATN);
 	    output_float(EOI);
 	    output_float(DAV);
@@ -176,7 +1166,7 @@ char gpib_controller_assign(int address) {
 	
 	output_low(IFC); // Assert interface clear. Resets bus and makes it 
 	                 // controller in charge.
-	delay_ms(200);
+	delay_us(IFC_US);
 	output_float(IFC); // Finishing clearing interface
 	
 	output_low(REN); // Put all connected devices into "remote" mode
@@ -186,24 +1176,20 @@ char gpib_controller_assign(int address) {
 
 char gpib_cmd(char *bytes, int length) {
     // Write a GPIB CMD byte to the bus
+    ton_addressed = false; // Any command may change who is talking
 	return _gpib_write(bytes, length, 1, 0);
 }
 
-char gpib_write(char *bytes, int length, useEOI) {
+char gpib_write(char *bytes, int length, BOOLEAN useEOI) {
     // Write a GPIB data string to the bus
 	return _gpib_write(bytes, length, 0, useEOI);
 }
 
-char _gpib_write(char *bytes, int length, BOOLEAN attention, BOOLEAN useEOI) {
-    /* 
-    * Write a string of bytes to the bus
-    * bytes: array containing characters to be written
-    * length: number of bytes to write, 0 if not known.
-    * attention: 1 if this is a gpib command, 0 for data
+char gpib_write_begin(BOOLEAN attention) {
+    /*
+    * Take the talker role on the bus, ready for gpib_write_byte()
+    * attention: 1 if the following bytes are gpib commands, 0 for data
     */
-	char a; // Storage variable for the current character
-	int i; // Loop counter variable
-
 	output_high(PE);
 	
 	if(attention) // If byte is a gpib bus command
@@ -212,12 +1198,17 @@ char _gpib_write(char *bytes, int length, BOOLEAN attention, BOOLEAN useEOI) {
 		                 // this is a cmd byte.
 	}
 	
-	if(length==0) // If the length was unknown
-	{
-		length = strlen((char*)bytes); // Calculate the number of bytes to 
-		                               // be sent
+	write_atn = attention;
+	hs488_state = HS488_OFF;
+	if (hs488 && !attention && CONTROLLER_MODE) {
+	    hs488_state = HS488_FIRST;
 	}
 	
+	#ifdef WITH_HS_PROFILE
+	// Command bytes go to every device, so they aren't profiled
+	hs_select((attention || !CONTROLLER_MODE) ? hs_none : partnerAddress);
+	#endif
+	
 	output_high(TE); // Enable talking
 	
 	output_high(EOI);
@@ -230,11 +1221,11 @@ char _gpib_write(char *bytes, int length, BOOLEAN attention, BOOLEAN useEOI) {
     #ifdef WITH_TIMEOUT
 	seconds = 0;
 	enable_interrupts(INT_TIMER2);
-	while((input(NDAC) || !(input(NRFD))) && (seconds <= timeout)) {
+	while((input(NDAC) || !(input(NRFD))) && (seconds <= active_timeout)) {
 	    restart_wdt();
-		if(seconds >= timeout) {
-		    if (debug == 1) {
-			    printf("Timeout: Before writing %c %x ", bytes[0], bytes[0]);
+		if((seconds >= active_timeout) || abort_req) {
+		    if (DEBUG_MSGS) {
+			    printf(tx_put, "Timeout: Before writing%c", eot_char);
 			}
 			device_talk = false;
 			device_srq = false;
@@ -242,101 +1233,230 @@ char _gpib_write(char *bytes, int length, BOOLEAN attention, BOOLEAN useEOI) {
 			return 1;
 		}
 	}
-	disable_interrupts(INT_TIMER2);
+	wait_end();
     #else
 	while(input(NDAC)){} 
     #endif
 	
+	return 0;
+}
+
+char hs488_wait_nrfd(void) {
+    // Wait for all listeners to be ready for the next HS488 byte
+    #ifdef WITH_TIMEOUT
+	seconds = 0;
+	enable_interrupts(INT_TIMER2);
+	HS_START();
+	while(!(input(NRFD)) && (seconds <= active_timeout)) {
+	    restart_wdt();
+		if((seconds >= active_timeout) || abort_req) {
+		    if (DEBUG_MSGS) {
+			    printf(tx_put, "Timeout: Waiting for NRFD to go high while writing HS488%c", eot_char);
+		    }
+		    prep_gpib_pins();
+			return 1;
+		}
+	}
+	wait_end();
+	HS_STOP(HS_NRFD_HI);
+    #else
+	while(!(input(NRFD))){}
+    #endif
+	return 0;
+}
+
+char hs488_write_byte(char a, BOOLEAN useEOI) {
+    /*
+    * Send a byte with the non-interlocked HS488 handshake. Listeners only
+    * hold off the talker with NRFD, so DAV is pulsed without waiting for
+    * NDAC. The data lines settle for 2 cycles (434ns, more than the 350ns
+    * T1 of HS488) before DAV, which then stays low for another 434ns.
+    */
+	if (hs488_wait_nrfd()) {
+	    return 1;
+	}
+	output_b(a^0xff);
+	if(useEOI) {
+		output_low(EOI);
+	}
+	delay_cycles(2);
+	output_low(DAV);
+	delay_cycles(2);
+	output_high(DAV);
 	
+	if(useEOI) {
+	    // End of the message, wait until the listeners have caught up
+	    return hs488_wait_nrfd();
+	}
+	return 0;
+}
+
+#inline
+void t1_settle(BOOLEAN useEOI) {
+    /*
+    * Give the data (and EOI) lines time to settle before DAV is asserted.
+    * One cycle is 217ns at 18.432MHz; the instructions around the call add
+    * a little more, so these are minimums.
+    */
+    switch (t1_profile) {
+        case T1_2US:
+            delay_cycles(10);
+            break;
+        case T1_1US1:
+            delay_cycles(6);
+            break;
+        case T1_350NS:
+            delay_cycles(2);
+            break;
+        case T1_AUTO:
+            if (write_atn) {
+                delay_cycles(10);
+            }
+            else if (useEOI) {
+                delay_cycles(6);
+            }
+            else {
+                delay_cycles(2);
+            }
+            break;
+    }
+}
+
+char gpib_write_byte(char a, BOOLEAN useEOI) {
+    /*
+    * Handshake a single byte onto the bus, after gpib_write_begin()
+    * a: the byte to write
+    * useEOI: 1 to assert EOI with this byte
+    */
+	#ifdef VERBOSE_DEBUG
+	printf(tx_put, "Writing byte: %c %x %c", a, a, eot_char);
+	#endif
 	
-	for(i = 0;i < length;i++) { //Loop through each character, write to bus
-		a = bytes[i]; // So I don't have to keep typing bytes[i]
-		
-		#ifdef VERBOSE_DEBUG
-		printf("Writing byte: %c %x %c", a, a, eot_char);
-		#endif
-		
-		// Wait for NDAC to go low, indicating previous bit is now done with
+	if ((!CONTROLLER_MODE) && !input(ATN)) {
+	    // The controller has taken the bus back, stop talking
+	    prep_gpib_pins();
+	    return 1;
+	}
+	if (abort_req) {
+	    prep_gpib_pins(); // ++abort, the caller finishes with xfer_error()
+	    return 1;
+	}
+	
+	/*
+	* HS488 (++hs488). The first byte is always interlocked. A listener
+	* that can do HS488 then leaves NDAC high, while any other listener
+	* asserts NDAC before it releases NRFD for the next byte. So once NRFD
+	* is high again, NDAC still being high means every listener can do
+	* HS488. A listener can go back to the interlocked handshake at any
+	* time by asserting NDAC.
+	*/
+	if (hs488_state == HS488_FIRST) {
+	    hs488_state = HS488_DETECT;
+	}
+	else if (hs488_state == HS488_DETECT) {
+	    if (hs488_wait_nrfd()) {
+	        return 1;
+	    }
+	    hs488_state = input(NDAC) ? HS488_ON : HS488_OFF;
+	}
+	if (hs488_state == HS488_ON) {
+	    if (input(NDAC)) {
+	        return hs488_write_byte(a, useEOI);
+	    }
+	    hs488_state = HS488_OFF;
+	}
+	
+	// Wait for NDAC to go low, indicating previous bit is now done with
     #ifdef WITH_TIMEOUT
-		seconds = 0;
-		enable_interrupts(INT_TIMER2);
-		while(input(NDAC) && (seconds <= timeout)) {
-		    restart_wdt();
-			if(seconds >= timeout) {
-			    if (debug == 1) {
-				    printf("Timeout: Waiting for NDAC to go low while writing%c", eot_char);
-				}
-				device_talk = false;
-				device_srq = false;
-				prep_gpib_pins();
-				return 1;
+	seconds = 0;
+	enable_interrupts(INT_TIMER2);
+	HS_START();
+	while(input(NDAC) && (seconds <= active_timeout)) {
+	    restart_wdt();
+		if((seconds >= active_timeout) || abort_req) {
+		    if (DEBUG_MSGS) {
+			    printf(tx_put, "Timeout: Waiting for NDAC to go low while writing%c", eot_char);
 			}
+			device_talk = false;
+			device_srq = false;
+			prep_gpib_pins();
+			return 1;
 		}
-		disable_interrupts(INT_TIMER2);
+	}
+	wait_end();
+	HS_STOP(HS_NDAC_LO);
     #else
-		while(input(NDAC)){} 
+	while(input(NDAC)){} 
     #endif
 
-		// Put the byte on the data lines
-		a = a^0xff;
-		output_b(a);
-	
-		output_float(NRFD);
+	// Put the byte on the data lines
+	a = a^0xff;
+	output_b(a);
+
+	output_float(NRFD);
 
-		// Wait for listeners to be ready for data (NRFD should be high)
+	// Wait for listeners to be ready for data (NRFD should be high)
     #ifdef WITH_TIMEOUT
-		seconds = 0;
-		enable_interrupts(INT_TIMER2);
-		while(!(input(NRFD)) && (seconds <= timeout)) {
-		    restart_wdt();
-			if(seconds >= timeout) {
-			    if (debug == 1) {
-				    printf("Timeout: Waiting for NRFD to go high while writing%c", eot_char);
-			    }
-			    device_talk = false;
-			    device_srq = false;
-			    prep_gpib_pins();
-				return 1;
-			}
+	seconds = 0;
+	enable_interrupts(INT_TIMER2);
+	HS_START();
+	while(!(input(NRFD)) && (seconds <= active_timeout)) {
+	    restart_wdt();
+		if((seconds >= active_timeout) || abort_req) {
+		    if (DEBUG_MSGS) {
+			    printf(tx_put, "Timeout: Waiting for NRFD to go high while writing%c", eot_char);
+		    }
+		    device_talk = false;
+		    device_srq = false;
+		    prep_gpib_pins();
+			return 1;
 		}
-		disable_interrupts(INT_TIMER2);
+	}
+	wait_end();
+	HS_STOP(HS_NRFD_HI);
     #else		
-		while(!(input(NRFD))){}
+	while(!(input(NRFD))){}
     #endif
-		
-		if((i==length-1) && (useEOI)) { // If last byte in string
-			output_low(EOI); // Assert EOI
-		}
-		
-		output_low(DAV); // Inform listeners that the data is ready to be read
+	
+	if(useEOI) { // If last byte in string
+		output_low(EOI); // Assert EOI
+	}
+	
+	t1_settle(useEOI);
+	output_low(DAV); // Inform listeners that the data is ready to be read
 
-		
-		// Wait for NDAC to go high, all listeners have accepted the byte
+	
+	// Wait for NDAC to go high, all listeners have accepted the byte
     #ifdef WITH_TIMEOUT
-		seconds = 0;
-		enable_interrupts(INT_TIMER2);
-		while(!(input(NDAC)) && (seconds <= timeout)) {
-		    restart_wdt();
-			if(seconds >= timeout) {
-			    if (debug == 1) {
-			        printf("Timeout: Waiting for NDAC to go high while writing%c", eot_char);
-			    }
-			    device_talk = false;
-			    device_srq = false;
-			    prep_gpib_pins();
-				return 1;
-			}
+	seconds = 0;
+	enable_interrupts(INT_TIMER2);
+	HS_START();
+	while(!(input(NDAC)) && (seconds <= active_timeout)) {
+	    restart_wdt();
+		if((seconds >= active_timeout) || abort_req) {
+		    if (DEBUG_MSGS) {
+		        printf(tx_put, "Timeout: Waiting for NDAC to go high while writing%c", eot_char);
+		    }
+		    device_talk = false;
+		    device_srq = false;
+		    prep_gpib_pins();
+			return 1;
 		}
-		disable_interrupts(INT_TIMER2);
+	}
+	wait_end();
+	HS_STOP(HS_NDAC_HI);
     #else
-		while(!(input(NDAC))){} 
+	while(!(input(NDAC))){} 
     #endif
-		
-		output_high(DAV); // Byte has been accepted by all, indicate 
-		                   // byte is no longer valid
-		
-	} // Finished outputing all bytes to listeners
+	
+	output_high(DAV); // Byte has been accepted by all, indicate 
+	                   // byte is no longer valid
+	
+	return 0;
+}
 
+void gpib_write_end(BOOLEAN attention) {
+    // Give up the talker role after a successful gpib_write_begin()
 	output_low(TE); // Disable talking on datalines
 
 	// Float all data lines 
@@ -349,16 +1469,44 @@ char _gpib_write(char *bytes, int length, BOOLEAN attention, BOOLEAN useEOI) {
 	output_float(DIO7);
 	output_float(DIO8);
 	
-	if(attention) { // If byte was a gpib cmd byte
-		output_high(ATN); // Release ATN line
+	if(attention) { // If byte was a gpib cmd byte
+		output_high(ATN); // Release ATN line
+	}
+	
+	output_float(DAV);
+	output_float(EOI);
+	output_high(NDAC);
+	output_high(NRFD);
+
+	output_low(PE);
+}
+
+char _gpib_write(char *bytes, int length, BOOLEAN attention, BOOLEAN useEOI) {
+    /* 
+    * Write a string of bytes to the bus
+    * bytes: array containing characters to be written
+    * length: number of bytes to write, 0 if not known.
+    * attention: 1 if this is a gpib command, 0 for data
+    */
+	int i; // Loop counter variable
+	
+	if(length==0) // If the length was unknown
+	{
+		length = strlen((char*)bytes); // Calculate the number of bytes to 
+		                               // be sent
 	}
 	
-	output_float(DAV);
-	output_float(EOI);
-	output_high(NDAC);
-	output_high(NRFD);
+	if(gpib_write_begin(attention)) {
+	    return 1;
+	}
+	
+	for(i = 0;i < length;i++) { //Loop through each character, write to bus
+		if(gpib_write_byte(bytes[i], (i==length-1) && (useEOI))) {
+		    return 1;
+		}
+	} // Finished outputing all bytes to listeners
 
-	output_low(PE);
+	gpib_write_end(attention);
 	
 	return 0;
 	
@@ -380,18 +1528,20 @@ char gpib_receive(char *byt) {
     #ifdef WITH_TIMEOUT
     seconds = 0;
     enable_interrupts(INT_TIMER2);
-	while(input(DAV) && (seconds <= timeout)) {
+    HS_START();
+	while(input(DAV) && (seconds <= active_timeout)) {
 	    restart_wdt();
-		if(seconds >= timeout) {
-		    if (debug == 1) {
-			    printf("Timeout: Waiting for DAV to go low while reading%c", eot_char);
+		if((seconds >= active_timeout) || abort_req) {
+		    if (DEBUG_MSGS) {
+			    printf(tx_put, "Timeout: Waiting for DAV to go low while reading%c", eot_char);
 		    }
 		    device_listen = false;
 		    prep_gpib_pins();
 			return 0xff;
 		}
 	}
-	disable_interrupts(INT_TIMER2);
+	wait_end();
+	HS_STOP(HS_DAV_LO);
     #else
 	while(input(DAV)) {} 
     #endif
@@ -405,7 +1555,7 @@ char gpib_receive(char *byt) {
 	eoiStatus = input(EOI);
 	
 	#ifdef VERBOSE_DEBUG
-	printf("Got byte: %c %x ", a, a);
+	printf(tx_put, "Got byte: %c %x ", a, a);
 	#endif
 	
 	// Un-assert NDAC, informing talker that we have accepted the byte
@@ -415,18 +1565,18 @@ char gpib_receive(char *byt) {
     #ifdef WITH_TIMEOUT
     seconds = 0;
     enable_interrupts(INT_TIMER2);
-	while(!(input(DAV)) && (seconds<=timeout) ) {
+	while(!(input(DAV)) && (seconds<=active_timeout) ) {
 	    restart_wdt();
-		if(seconds >= timeout) {
-		    if (debug == 1){
-			    printf("Timeout: Waiting for DAV to go high while reading%c", eot_char);
+		if((seconds >= active_timeout) || abort_req) {
+		    if (DEBUG_MSGS){
+			    printf(tx_put, "Timeout: Waiting for DAV to go high while reading%c", eot_char);
 		    }
 		    device_listen = false;
 		    prep_gpib_pins();
 			return 0xff;
 		}
 	}
-	disable_interrupts(INT_TIMER2);
+	wait_end();
     #else
 	while(!(input(DAV))) {} 
     #endif
@@ -435,7 +1585,7 @@ char gpib_receive(char *byt) {
 	output_low(NDAC);
 	
 	#ifdef VERBOSE_DEBUG
-	printf("EOI: %c%c", eoiStatus, eot_char);
+	printf(tx_put, "EOI: %c%c", eoiStatus, eot_char);
 	#endif
 	
 	*byt = a;
@@ -443,42 +1593,175 @@ char gpib_receive(char *byt) {
 	return eoiStatus;
 }
 
-char gpib_read(boolean read_until_eoi) {
-	char readCharacter,eoiStatus;
-	char readBuf[100];
-	char i = 0, j=0;
+void bus_release(void) {
+    // Stop whatever transfer was going on, leaving the bus idle
+    prep_gpib_pins();
+    if (CONTROLLER_MODE) {
+        cmd_buf[0] = CMD_UNT;
+        gpib_cmd(cmd_buf, 1);
+        cmd_buf[0] = CMD_UNL;
+        gpib_cmd(cmd_buf, 1);
+    }
+}
+
+char xfer_error(char error) {
+    /*
+    * The FRAME_ERR_* code for a transfer that failed with error. If it was
+    * ended by ++abort, the transaction is finished here with UNT and UNL so
+    * that the bus is idle for whatever comes next.
+    */
+    if (!abort_req) {
+        return error;
+    }
+    abort_req = false;
+    bus_release();
+    return FRAME_ERR_ABORT;
+}
+
+void read_send(void) {
+    // Send the end of a finished read to the host
+	if (read_error && (pack != PACK_OFF)) {
+	    // Packed responses are framed even with ++frame 0, errors too
+	    frame_header(0, FRAME_END | FRAME_PACKED, read_error);
+	}
+	else if (read_error) {
+	    frame_error(read_error);
+	}
+	else {
+	    read_chunk(read_buf, read_len-strip, read_flags);
+	    if ((eot_enable == 1) && (!framing) && (pack == PACK_OFF)) {
+		    printf(tx_put, "%c", eot_char);
+	    }
+	}
+	read_len = 0;
+}
+
+void read_end(char error) {
+    /*
+    * Finish the read in progress. error is the FRAME_ERR_* code it failed
+    * with, or FRAME_ERR_NONE once the whole response is in read_buf. A
+    * prefetch keeps the result for ++read, see prefetch_claim().
+    */
 	char errorFound = 0;
-	boolean reading_done = false;	
+	
+	read_active = false;
+	read_waiting = false;
+	read_error = error;
+	if (!read_hold) {
+	    read_send();
+	}
+	
+	#ifdef VERBOSE_DEBUG
+	printf(tx_put, "gpib_read loop end\n\r");
+	#endif
+	
+	if (CONTROLLER_MODE && !error) {
+	    // Command all talkers and listeners to stop
+	    cmd_buf[0] = CMD_UNT;
+	    errorFound = errorFound || gpib_cmd(cmd_buf, 1);
+	    cmd_buf[0] = CMD_UNL;
+	    errorFound = errorFound || gpib_cmd(cmd_buf, 1);
+	}
+	
+	if (CONTROLLER_MODE) {
+	    tmo_end(partnerAddress, error || errorFound);
+	}
+	
+	#ifdef VERBOSE_DEBUG
+	printf(tx_put, "gpib_read end\n\r");
+	#endif
+}
 
-	char *bufPnt;
-	bufPnt = &readBuf[0];
+char read_start(boolean read_until_eoi) {
+    /*
+    * Address partnerAddress to talk and get ready to receive from it. The
+    * data itself is taken by read_step().
+    */
+	char errorFound = 0;
 	
 	#ifdef VERBOSE_DEBUG
-	printf("gpib_read start\n\r");
+	printf(tx_put, "gpib_read start\n\r");
 	#endif
 	
-	if (mode) {
+	if (CONTROLLER_MODE) {
 	    // Command all talkers and listeners to stop
 	    cmd_buf[0] = CMD_UNT;
 	    errorFound = errorFound || gpib_cmd(cmd_buf, 1);
 	    cmd_buf[0] = CMD_UNL;
 	    errorFound = errorFound || gpib_cmd(cmd_buf, 1);
-	    if(errorFound){return 1;}
+	    if(errorFound){read_end(xfer_error(FRAME_ERR_ADDRESS));return 1;}
 	
 	    // Set the controller into listener mode
 	    cmd_buf[0] = myAddress + 0x20;
 	    errorFound = errorFound || gpib_cmd(cmd_buf, 1);
-	    if(errorFound){return 1;}
+	    if(errorFound){read_end(xfer_error(FRAME_ERR_ADDRESS));return 1;}
 	
 	    // Set target device into talker mode
 	    cmd_buf[0] = partnerAddress + 0x40;
 	    errorFound = gpib_cmd(cmd_buf, 1);
-	    if(errorFound){return 1;}
+	    if(errorFound){read_end(xfer_error(FRAME_ERR_ADDRESS));return 1;}
 	}
+	#ifdef WITH_HS_PROFILE
+	hs_select(CONTROLLER_MODE ? partnerAddress : hs_none);
+	#endif
 	
-	i = 0;
-	bufPnt = &readBuf[0];
+	read_eoi = read_until_eoi;
+	read_len = 0;
+	pack_len = 0;
+	pack_reset();
+	read_waiting = false;
+	read_active = true;
+	return 0;
+}
+
+void read_step(void) {
+    /*
+    * Receive the next chunk of the read started by read_start(), ending
+    * the read once its end condition is seen. The main loop calls this
+    * until read_active is cleared, taking in host input between chunks, so
+    * a long or stuck read can be ended by ++abort. Until the talker has a
+    * byte ready it returns straight away, so input behind a ++prefetch
+    * is not held up by an instrument that has nothing to say.
+    */
+	char readCharacter,eoiStatus;
+	char i = read_len;
+	boolean reading_done = false;
 	
+	if (abort_req) {
+	    read_end(xfer_error(FRAME_ERR_NONE));
+	    return;
+	}
+	if (read_hold && (i == read_chunk_size)) {
+	    return; // A prefetch filled read_buf, the talker waits for ++read
+	}
+	if (input(DAV)) {
+	    // Same wait as in gpib_receive(), spread over calls
+	    restart_wdt();
+	    if (!read_waiting) {
+	        read_waiting = true;
+	        output_high(NRFD);
+	        output_low(NDAC);
+	        output_float(DAV);
+	        seconds = 0;
+	        enable_interrupts(INT_TIMER2);
+	        HS_START();
+	    }
+	    else if (seconds >= active_timeout) {
+	        if (DEBUG_MSGS) {
+	            printf(tx_put, "Timeout: Waiting for DAV to go low while reading%c", eot_char);
+	        }
+	        wait_end();
+	        device_listen = false;
+	        prep_gpib_pins();
+	        read_end(xfer_error(FRAME_ERR_TIMEOUT));
+	    }
+	    return;
+	}
+	if (read_waiting) {
+	    read_waiting = false;
+	    wait_end(); // Keep the talker's response time for the timeout
+	    HS_STOP(HS_DAV_LO);
+	}
 
 	/*
 	* In this section you will notice that I buffer the received characters, 
@@ -489,57 +1772,39 @@ char gpib_read(boolean read_until_eoi) {
 	*
 	* The other option of going putc(readBuf[x]);x++; Is for some reason slower 
 	* than getting a pointer on the first element, then iterating that pointer 
-	* through the buffer (as I have done here).
+	* through the buffer (as is done in send_chunk).
+	*
+	* With framing enabled every flush of read_buf is sent as its own chunk, so
+	* the host always knows how many bytes to expect and where the response
+	* ends, regardless of what the data contains.
 	*/
-	#ifdef VERBOSE_DEBUG
-	printf("gpib_read loop start\n\r");
-	#endif
-	if(read_until_eoi == 1){
-		do {
-			eoiStatus = gpib_receive(&readCharacter); // eoiStatus is line lvl
-			if(eoiStatus==0xff){return 1;}
+	do {
+		eoiStatus = gpib_receive(&readCharacter); // eoiStatus is line lvl
+		if(eoiStatus==0xff){read_end(xfer_error(FRAME_ERR_TIMEOUT));return;}
+		if (read_eoi) {
 			if (eos_code != 0) {
 			    if((readCharacter != eos_string[0]) || (eoiStatus)){ // Check for EOM char
-			        readBuf[i] = readCharacter; //Copy the read char into the buffer
+			        read_buf[i] = readCharacter; //Copy the read char into the buffer
 			        i++;
 			    }
 			}
 			else {
 			    if((readCharacter == eos_string[1]) && (eoiStatus == 0)) {
-			        if (readBuf[i-1] == eos_string[0]) {
+			        if (read_buf[i-1] == eos_string[0]) {
 			            i--;
 			        }
 			    }
 			    else {
-			        readBuf[i] = readCharacter;
+			        read_buf[i] = readCharacter;
 			        i++;
 			    }
 			}
-			if(i == 100){
-				for(j=0;j<100;++j){
-					putc(*bufPnt);
-					++bufPnt;
-				}
-				i = 0;
-				bufPnt = &readBuf[0];
-				#ifdef WITH_WDT
-				restart_wdt();
-				#endif
-			}
-
-		} while (eoiStatus);
-
-		for(j=0;j<i-strip;++j){
-			putc(*bufPnt);
-			++bufPnt;
+			reading_done = !eoiStatus;
 		}
-	} else {
-		do {
-			eoiStatus = gpib_receive(&readCharacter);
-			if(eoiStatus==0xff){return 1;}
+		else {
 			if (eos_code != 0) {
 			    if(readCharacter != eos_string[0]){ // Check for EOM char
-			        readBuf[i] = readCharacter; //Copy the read char into the buffer
+			        read_buf[i] = readCharacter; //Copy the read char into the buffer
 			        i++;
 			    }
 			    else {
@@ -548,139 +1813,745 @@ char gpib_read(boolean read_until_eoi) {
 			}
 			else {
 			    if(readCharacter == eos_string[1]) {
-			        if (readBuf[i-1] == eos_string[0]) {
+			        if (read_buf[i-1] == eos_string[0]) {
 			            i--;
 			            reading_done = true;
 			        }
 			    }
 			    else {
-			        readBuf[i] = readCharacter;
+			        read_buf[i] = readCharacter;
 			        i++;
 			    }
 			}
-			if(i == 100){
-				for(j=0;j<100;++j){
-					putc(*bufPnt);
-					++bufPnt;
-				}
-				i = 0;
-				bufPnt = &readBuf[0];
-				#ifdef WITH_WDT
-				restart_wdt();
-				#endif
+		}
+		if((i == read_chunk_size) && !reading_done){
+			if (!read_hold) {
+			    read_chunk(read_buf, read_chunk_size, 0);
+			    i = 0;
+			    #ifdef WITH_WDT
+			    restart_wdt();
+			    #endif
 			}
+			read_len = i;
+			return; // Back to the main loop until the next chunk
+		}
+	} while (!reading_done);
+
+	read_len = i;
+	if (read_eoi || !eoiStatus) {
+	    read_flags = FRAME_END | FRAME_EOI;
+	}
+	else {
+	    read_flags = FRAME_END;
+	}
+	read_end(FRAME_ERR_NONE);
+}
+
+void prefetch_start(void) {
+    /*
+    * ++prefetch: start reading the response to the write just made. It is
+    * kept in read_buf until ++read asks for it, so the host's round trip
+    * and the bus transfer overlap. It ends the way the host's last read
+    * did, ++read or ++read eoi.
+    */
+    read_hold = true;
+    tmo_begin(partnerAddress);
+    read_start((prefetch_eoi == 0xFF) ? eoiUse : prefetch_eoi);
+}
+
+void prefetch_claim(void) {
+    // ++read after a prefetch: send what has been received so far
+    read_hold = false;
+    if (!read_active) {
+        read_send();
+    }
+    else if (read_len == read_chunk_size) {
+        read_chunk(read_buf, read_chunk_size, 0);
+        read_len = 0;
+    }
+}
+
+void prefetch_drop(void) {
+    // Anything but ++read after a prefetch throws the response away
+    read_hold = false;
+    read_len = 0;
+    if (read_active) {
+        read_active = false;
+        active_timeout = timeout;
+        bus_release();
+    }
+}
+
+char gpib_read(boolean read_until_eoi) {
+    /*
+    * Read from partnerAddress, learning how long it takes to respond. In
+    * controller mode this only starts the read, which the main loop then
+    * steps through. In device mode the controller decides when the bus is
+    * ours, so the read is finished before returning.
+    */
+    if (CONTROLLER_MODE) {
+        prefetch_eoi = read_until_eoi;
+    }
+    if (read_hold) {
+        read_eoi = read_until_eoi; // For any bytes still to come
+        prefetch_claim();
+        return 0;
+    }
+    if (CONTROLLER_MODE) {
+        tmo_begin(partnerAddress);
+    }
+    if (read_start(read_until_eoi)) {
+        return 1;
+    }
+    if (!CONTROLLER_MODE) {
+        while (read_active) {
+            read_step();
+        }
+    }
+    return 0;
+}
+
+char addressTarget(int address) {
+    /*
+    * Address the currently specified GPIB address (as set by the ++addr cmd)
+    * to listen
+    */
+    char writeError = 0;
+    cmd_buf[0] = CMD_UNT;
+	writeError = writeError || gpib_cmd(cmd_buf, 1);
+    cmd_buf[0] = CMD_UNL; // Everyone stop listening
+    writeError = writeError || gpib_cmd(cmd_buf, 1);
+    cmd_buf[0] = address + 0x20;
+    writeError = writeError || gpib_cmd(cmd_buf, 1);
+    return writeError;
+}
 
-		} while (reading_done == false);
-		reading_done = false;
+boolean srq_state(void) {
+    return !((boolean)input(SRQ));
+}
+
+void serial_poll(int address) {
+    char error = 0;
+    char status_byte;
+    cmd_buf[0] = CMD_SPE; // enable serial poll
+	error = error || gpib_cmd(cmd_buf, 1);
+	cmd_buf[0] = address + 0x40;
+    error = error || gpib_cmd(cmd_buf, 1);
+    if (error) {
+        frame_error(FRAME_ERR_ADDRESS);
+        return;
+    }
+    error = gpib_receive(&status_byte);
+    if (error == 1) error = 0; // gpib_receive returns EOI lvl and 0xFF on errors
+    if (error == 0xFF) error = 1;
+    cmd_buf[0] = CMD_SPD; // disable serial poll
+	gpib_cmd(cmd_buf, 1);
+	if (!error)
+	    send_reply(&status_byte, 1);
+	else
+	    frame_error(FRAME_ERR_TIMEOUT);
+}
+
+char raw_talk(char c, BOOLEAN useEOI) {
+    // Write one byte in raw mode, taking the bus first if needed
+    char error;
+    if (!raw_talking) {
+        error = addressTarget(partnerAddress);
+        cmd_buf[0] = myAddress + 0x40;
+        error = error || gpib_cmd(cmd_buf, 1);
+        error = error || gpib_write_begin(0);
+        if (error) {
+            return 1;
+        }
+        raw_talking = true;
+    }
+    if (gpib_write_byte(c, useEOI)) {
+        raw_talking = false;
+        return 1;
+    }
+    return 0;
+}
+
+void raw_mode(void) {
+    /*
+    * Transparent pass-through between the host and partnerAddress. Host
+    * bytes are written to the bus unfiltered, LF included. RAW_ESC RAW_EOM
+    * ends the message (with EOI on its last byte if eoiUse is set) and
+    * turns the bus around so that whatever the instrument talks is sent
+    * straight back to the host. The next host byte takes the bus back.
+    * Each byte is held until the next one arrives, so that EOI can go on
+    * the last one, or until the host has been quiet for raw_idle_ms, so
+    * that a typed message reaches the bus without one. Only RAW_ESC is
+    * special, see usb_to_gpib.h.
+    */
+    char c, eoiStatus;
+    char error;
+    char held = 0;
+    boolean holding = false;
+    boolean escape = false;
+    boolean listening = false;
+    
+    raw_talking = false;
+    abort_watch = false; // A raw "++abort" line is for the instrument
+    for(;;) {
+        restart_wdt();
+        
+        if(rx_in != rx_out) {
+            c = rx_get();
+            listening = false;
+            if (escape) {
+                escape = false;
+                if (c == RAW_EXIT) {
+                    break;
+                }
+                if (c == RAW_EOM) {
+                    if (holding) {
+                        holding = false;
+                        raw_talk(held, eoiUse);
+                    }
+                    if (raw_talking) {
+                        gpib_write_end(0);
+                        raw_talking = false;
+                    }
+                    
+                    cmd_buf[0] = CMD_UNT;
+                    error = gpib_cmd(cmd_buf, 1);
+                    cmd_buf[0] = CMD_UNL;
+                    error = error || gpib_cmd(cmd_buf, 1);
+                    cmd_buf[0] = myAddress + 0x20;
+                    error = error || gpib_cmd(cmd_buf, 1);
+                    cmd_buf[0] = partnerAddress + 0x40;
+                    error = error || gpib_cmd(cmd_buf, 1);
+                    if (!error) {
+                        listening = true;
+                        output_high(NRFD); // Ready for data
+                        output_low(NDAC);
+                    }
+                    continue;
+                }
+                if (c != RAW_ESC) {
+                    continue; // Unknown escape, drop it
+                }
+            }
+            else if (c == RAW_ESC) {
+                escape = true;
+                continue;
+            }
+            
+            if (holding) {
+                raw_talk(held, 0);
+            }
+            held = c;
+            holding = true;
+            seconds = 0;
+            enable_interrupts(INT_TIMER2);
+        }
+        else if (holding && (seconds >= raw_idle_ms)) {
+            holding = false; // The host paused, don't wait for the EOM
+            raw_talk(held, 0);
+        }
+        else if (listening && !input(DAV)) {
+            eoiStatus = gpib_receive(&c);
+            if (eoiStatus == 0xff) {
+                listening = false;
+            }
+            else {
+                tx_put(c);
+                output_high(NRFD); // gpib_receive leaves NRFD asserted
+            }
+        }
+    }
+    
+    if (holding) {
+        raw_talk(held, 0);
+    }
+    if (raw_talking) {
+        gpib_write_end(0);
+    }
+    cmd_buf[0] = CMD_UNT;
+    gpib_cmd(cmd_buf, 1);
+    cmd_buf[0] = CMD_UNL;
+    gpib_cmd(cmd_buf, 1);
+    abort_pos = 0;
+    abort_watch = true;
+}
+
+char write_line(char *pnt) {
+    // Write a line of text from the host, followed by the EOS chars if any
+    char writeError;
+    
+    #ifdef VERBOSE_DEBUG
+    printf(tx_put, "gpib_write: %s%c",pnt, eot_char);
+    #endif
+    
+    if(eos_code != 3) { // If have an EOS char, need to output 
+                        // termination byte to inst
+        writeError = gpib_write(pnt, 0, 0);
+        if (!writeError)
+	        writeError = gpib_write(eos_string, 0, eoiUse);
+	    #ifdef VERBOSE_DEBUG
+        printf(tx_put, "eos_string: %s",eos_string);
+        #endif
+    }
+    else {
+        writeError = gpib_write(pnt, 0, 1);
+    }
+    return writeError;
+}
+
+void bin_ack(char error) {
+    // Tell the host a binary packet has left the input ring
+    if (framing) {
+        frame_header(0, FRAME_ACK, error);
+    }
+    else {
+        tx_put(BIN_ACK);
+    }
+}
+
+void bin_packet(void) {
+    /*
+    * Take a binary packet out of the input ring, writing each payload byte to
+    * the bus as soon as it arrives instead of waiting for the whole packet.
+    * Consecutive packets with BIN_MORE set form one message: the target is 
+    * only addressed for the first one and EOI can only be asserted on the
+    * last one, so the size of a write is not limited by RAM.
+    */
+    char flags, length, c;
+    char writeError = 0;
+    boolean started = false;
+    
+    flags = rx_get();
+    length = rx_get();
+    
+    if (read_hold) {
+        prefetch_drop();
+    }
+    if (CONTROLLER_MODE) {
+        tmo_begin(partnerAddress);
+    }
+    if (CONTROLLER_MODE && !stream_active && !(talk_only && ton_addressed)) {
+        writeError = writeError || addressTarget(partnerAddress);
+        cmd_buf[0] = myAddress + 0x40;
+        writeError = writeError || gpib_cmd(cmd_buf, 1);
+        ton_addressed = talk_only && !writeError;
+    }
+    else if (!CONTROLLER_MODE && (!device_talk || device_srq) && !talk_only) {
+        writeError = 1; // Not addressed to talk, payload is discarded
+    }
+    
+    if ((length > 0) && !writeError) {
+        writeError = gpib_write_begin(0);
+        started = !writeError;
+    }
+    
+    while(length > 0) {
+        c = rx_get();
+        length--;
+        if (!writeError) {
+            writeError = gpib_write_byte(c, (length == 0) && (flags & BIN_EOI));
+        }
+    }
+    
+    if (started && !writeError) {
+        gpib_write_end(0);
+    }
+    if (CONTROLLER_MODE) {
+        tmo_end(partnerAddress, writeError);
+    }
+    
+    if (writeError) {
+        bin_ack(xfer_error(FRAME_ERR_TIMEOUT));
+        stream_active = false;
+        return;
+    }
+    bin_ack(FRAME_ERR_NONE);
+    
+    stream_active = (flags & BIN_MORE) && CONTROLLER_MODE;
+    if ((flags & BIN_READ) && !stream_active && CONTROLLER_MODE) {
+        gpib_read(eoiUse);
+    }
+    else if (prefetch && !stream_active && CONTROLLER_MODE) {
+        prefetch_start();
+    }
+}
+
+boolean ring_line(void) {
+    // True once the line at the head of the ring is complete, or fills it
+    unsigned int8 i;
+    for(i=rx_out;i!=rx_in;++i) {
+        if ((rx_buf[i] == 10) || (rx_buf[i] == 13)) {
+            return true;
+        }
+    }
+    return (unsigned int8)(rx_in + 1) == rx_out;
+}
+
+void ring_skip_line(void) {
+    // Drop the line at the head of the ring, terminator included
+    char c;
+    while(rx_in != rx_out) {
+        c = rx_buf[rx_out++];
+        if ((c == 10) || (c == 13)) {
+            return;
+        }
+    }
+}
+
+const char read_text[7] = "++read";
+
+char prefetch_line(void) {
+    /*
+    * The line after a ++prefetch write, looked at in the ring as buf still
+    * holds the prefetched response. +read, ++read and ++read eoi are taken
+    * out of the ring here and claim it, anything else drops the prefetch
+    * and is read into buf as usual. Returns 0 until enough of the line is
+    * in to tell, 1 if it was a read and 2 if not.
+    */
+    unsigned int8 i, n, first;
+    char c, arg = 0; // 1 after the space, then the first argument character
+    
+    n = rx_in - rx_out;
+    first = (n > 1) && (rx_buf[(unsigned int8)(rx_out + 1)] == '+') ? 0 : 1;
+    for(i=0;i<n;++i) {
+        c = rx_buf[(unsigned int8)(rx_out + i)];
+        if ((i + first) < 6) {
+            if (c != read_text[i + first]) {
+                break;
+            }
+        }
+        else if ((c == 10) || (c == 13)) {
+            rx_out += i + 1;
+            if (first) {
+                gpib_read(eoiUse); // +read
+            }
+            else if ((arg == 0) || (arg == 'e')) {
+                gpib_read(arg == 'e');
+            }
+            return 1; // ++read with anything else does nothing
+        }
+        else if ((i + first) == 6) {
+            if (first || (c != 32)) {
+                break;
+            }
+            arg = 1;
+        }
+        else if (arg == 1) {
+            arg = c;
+        }
+    }
+    if ((i == n) && ((unsigned int8)(n + 1) != 0)) {
+        return 0; // The line isn't all in yet
+    }
+    prefetch_drop();
+    return 2;
+}
+
+char host_poll(void) {
+    /*
+    * Empty the input ring. Binary packets are streamed to the bus and text is
+    * collected in buf. Returns 1 once buf holds a complete line.
+    * 
+    * buf shares its bank with read_buf, so while a read is in progress
+    * everything waits in the ring, which RDA_isr still scans for ++abort.
+    * A prefetched response is held instead, see prefetch_line(), and a
+    * binary packet drops it. In device mode a read can start whenever the
+    * controller addresses us to listen, so only whole lines are taken, and
+    * data for the controller stays at the head of the ring until we are
+    * addressed to talk.
+    */
+    char c;
+    dev_bin_held = false;
+    dev_pending = false;
+    while(rx_in != rx_out) {
+        if ((!CONTROLLER_MODE) && (!listen_only) && !input(ATN)) {
+            return 0; // Let the main loop service the controller first
+        }
+        if (read_active && !read_hold) {
+            return 0;
+        }
+        c = rx_buf[rx_out];
+        if ((c == BIN_START) && (buf_in == 0)) {
+            if ((!CONTROLLER_MODE) && (!listen_only) && (!talk_only) && (!device_talk || device_srq) && !dev_expired) {
+                dev_bin_held = true;
+                return 0; // Held in the ring until we are addressed to talk
+            }
+            rx_out++;
+            bin_packet();
+            dev_expired = false;
+            continue;
+        }
+        if ((buf_in == 0) && (c != 10) && (c != 13)) {
+            if (read_hold) {
+                c = prefetch_line();
+                if (c == 0) {
+                    return 0;
+                }
+                if (c == 1) {
+                    continue;
+                }
+                c = rx_buf[rx_out];
+            }
+            if ((!CONTROLLER_MODE) && (!listen_only)) {
+                if (!ring_line()) {
+                    return 0;
+                }
+                if ((c != '+') && (!talk_only) && (!device_talk || device_srq)) {
+                    dev_pending = true;
+                    return 0;
+                }
+            }
+        }
+        rx_out++;
+        if ((c == 10) || (c == 13)) { //both LF and CR are valid termination chars
+            if (buf_in > 0) {
+                buf[buf_in] = 0x00;
+                buf_in = 0;
+                return 1;
+            }
+        }
+        else if ((c >= 32) && (c <= 126) && (buf_in < buf_size)) {
+            buf[buf_in++] = c; // Only keep human readable ascii chars
+        }
+    }
+    return 0;
+}
 
-		for(j=0;j<i-strip;++j){
-			putc(*bufPnt);
-			++bufPnt;
-		}
-	}
-	
-	if (eot_enable == 1) {
-		printf("%c", eot_char);
-	}
-	
-	#ifdef VERBOSE_DEBUG
-	printf("gpib_read loop end\n\r");
-	#endif
-	
-	if (mode) {
-	    errorFound = 0;
-	    // Command all talkers and listeners to stop
-	    cmd_buf[0] = CMD_UNT;
-	    errorFound = errorFound || gpib_cmd(cmd_buf, 1);
-	    cmd_buf[0] = CMD_UNL;
-	    errorFound = errorFound || gpib_cmd(cmd_buf, 1);
-	}
-	
-	#ifdef VERBOSE_DEBUG
-	printf("gpib_read end\n\r");
-	#endif
+void baud_negotiate(unsigned int32 rate) {
+    /*
+    * Change the host link speed. The new rate is echoed at the old speed,
+    * then the host has baud_confirm_ms to send ++baud at the new
+    * speed. If it doesn't, the old speed is restored.
+    */
+    char i, old_index;
+    boolean confirmed = false;
+    
+    for(i=0;i<baud_count;++i) {
+        if (baud_rates[i] == rate) {
+            break;
+        }
+    }
+    if (i == baud_count) {
+        if (DEBUG_MSGS) {printf(tx_put, "Unsupported baud rate.%c", eot_char);}
+        return;
+    }
+    
+    reply_int(rate);
+    old_index = baud_index;
+    uart_set_baud(i);
+    rx_out = rx_in; // Anything received mid-switch is garbage
+    buf_in = 0;
+    
+    seconds = 0;
+    enable_interrupts(INT_TIMER2);
+    while(seconds < baud_confirm_ms) {
+        restart_wdt();
+        if (host_poll()) {
+            confirmed = cmd_is(buf, "++baud") && (buf[6] == 0x00);
+            break;
+        }
+    }
+    disable_interrupts(INT_TIMER2);
     
-	return errorFound;
+    if (confirmed) {
+        baud_index = i;
+        reply_int(rate);
+    }
+    else {
+        uart_set_baud(old_index);
+        rx_out = rx_in;
+        buf_in = 0;
+    }
 }
 
-char addressTarget(int address) {
+void monitor_poll(void) {
     /*
-    * Address the currently specified GPIB address (as set by the ++addr cmd)
-    * to listen
+    * Listen-only bus monitor (++lon 1 in device mode). Every byte on the bus
+    * is accepted, addressed or not, and sent to the host as a 4 byte record:
+    * TRACE_* flags, the data byte, then the Timer1 ticks since the previous
+    * record (1 tick = 8/(Fosc/4) = 1.736us). NRFD stays asserted until the
+    * record has been sent, so a fast talker is throttled instead of bytes
+    * being dropped.
     */
-    char writeError = 0;
-    cmd_buf[0] = CMD_UNT;
-	writeError = writeError || gpib_cmd(cmd_buf, 1);
-    cmd_buf[0] = CMD_UNL; // Everyone stop listening
-    writeError = writeError || gpib_cmd(cmd_buf, 1);
-    cmd_buf[0] = address + 0x20;
-    writeError = writeError || gpib_cmd(cmd_buf, 1);
-    return writeError;
+    char a, flags;
+    unsigned int16 now, delta;
+    
+    if (interrupt_active(INT_TIMER1)) {
+        clear_interrupt(INT_TIMER1);
+        if (trace_wraps < 2) trace_wraps++;
+    }
+    
+    output_low(NDAC);
+    output_high(NRFD); // Ready for the next byte
+    if (input(DAV)) {
+        return; // Nothing on the bus yet
+    }
+    
+    now = get_timer1();
+    output_low(NRFD);
+    a = input_b();
+    a = a^0xff;
+    flags = 0;
+    if (!input(ATN)) flags |= TRACE_ATN;
+    if (!input(EOI)) flags |= TRACE_EOI;
+    if (!input(SRQ)) flags |= TRACE_SRQ;
+    output_float(NDAC); // Byte accepted
+    
+    // Only count an overflow that happened before now was read
+    if (interrupt_active(INT_TIMER1) && !bit_test(now, 15)) {
+        clear_interrupt(INT_TIMER1);
+        if (trace_wraps < 2) trace_wraps++;
+    }
+    delta = now - trace_last;
+    if ((now < trace_last) && (trace_wraps > 0)) {
+        trace_wraps--; // Already accounted for by the subtraction
+    }
+    if (trace_wraps > 0) {
+        delta = 0xFFFF;
+        flags |= TRACE_OVF;
+    }
+    trace_wraps = 0;
+    trace_last = now;
+    
+    // Wait for DAV to go high (talker knows that we have the byte)
+    seconds = 0;
+    enable_interrupts(INT_TIMER2);
+    while(!(input(DAV)) && (seconds <= active_timeout)) {
+        restart_wdt();
+    }
+    disable_interrupts(INT_TIMER2);
+    output_low(NDAC);
+    
+    tx_put(flags);
+    tx_put(a);
+    tx_put(make8(delta, 1));
+    tx_put(make8(delta, 0));
 }
 
-boolean srq_state(void) {
-    return !((boolean)input(SRQ));
+void dev_hold_poll(void) {
+    /*
+    * Host data held for the controller at the head of the ring, a line or
+    * a packet, keeps host_poll() from reading anything behind it.
+    * If the controller hasn't taken it within the timeout it is discarded
+    * with a timeout ACK, so that commands such as ++mode 1 still get
+    * through on a bus with no controller. Timed by timer1 overflows, one
+    * every 113.8ms, as the handshake waits own the ms clock.
+    */
+    if (!dev_pending && !dev_bin_held) {
+        dev_held_ms = 0;
+        clear_interrupt(INT_TIMER1);
+        return;
+    }
+    if (interrupt_active(INT_TIMER1)) {
+        clear_interrupt(INT_TIMER1);
+        dev_held_ms += 114;
+    }
+    if (dev_held_ms < timeout) {
+        return;
+    }
+    dev_held_ms = 0;
+    if (dev_pending) {
+        dev_pending = false;
+        ring_skip_line();
+        bin_ack(FRAME_ERR_TIMEOUT);
+    }
+    else {
+        dev_expired = true; // host_poll() hands it to bin_packet() to drop
+    }
 }
 
-void serial_poll(int address) {
-    char error = 0;
-    char status_byte;
-    cmd_buf[0] = CMD_SPE; // enable serial poll
-	error = error || gpib_cmd(cmd_buf, 1);
-	cmd_buf[0] = address + 0x40;
-    error = error || gpib_cmd(cmd_buf, 1);
-    if (error) return;
-    error = gpib_receive(&status_byte);
-    if (error == 1) error = 0; // gpib_receive returns EOI lvl and 0xFF on errors
-    if (error == 0xFF) error = 1;
-    cmd_buf[0] = CMD_SPD; // disable serial poll
-	gpib_cmd(cmd_buf, 1);
-	if (!error)
-	    printf("%c%c", status_byte, eot_char);
+void device_atn(void) {
+    /*
+    * Accept and act on a command byte from the controller. Called as soon as
+    * ATN is seen asserted while in device mode.
+    */
+    output_low(NDAC);
+    gpib_receive(cmd_buf); // Get the CMD byte sent by the controller
+    output_high(NRFD);
+    if (cmd_buf[0] == partnerAddress + 0x40) {
+        device_talk = true;
+        #ifdef VERBOSE_DEBUG
+        printf(tx_put, "Instructed to talk%c", eot_char);
+        #endif
+    }
+    else if (cmd_buf[0] == partnerAddress + 0x20) {
+        device_listen = true;
+        #ifdef VERBOSE_DEBUG
+        printf(tx_put, "Instructed to listen%c", eot_char);
+        #endif
+    }
+    else if (cmd_buf[0] == CMD_UNL) {
+        device_listen = false;
+        #ifdef VERBOSE_DEBUG
+        printf(tx_put, "Instructed to stop listen%c", eot_char);
+        #endif
+    }
+    else if (cmd_buf[0] == CMD_UNT) {
+        device_talk = false;
+        #ifdef VERBOSE_DEBUG
+        printf(tx_put, "Instructed to stop talk%c", eot_char);
+        #endif
+    }
+    else if (cmd_buf[0] == CMD_SPE) {
+        device_srq = true;
+        #ifdef VERBOSE_DEBUG
+        printf(tx_put, "SQR start%c", eot_char);
+        #endif
+    }
+    else if (cmd_buf[0] == CMD_SPD) {
+        device_srq = false;
+        #ifdef VERBOSE_DEBUG
+        printf(tx_put, "SQR end%c", eot_char);
+        #endif
+    }
+    else if (cmd_buf[0] == CMD_DCL) {
+        send_reply(cmd_buf, 1);
+        if (dev_pending) {
+            ring_skip_line();
+            bin_ack(FRAME_ERR_NONE); // The held line is gone, the host may send more
+        }
+        dev_pending = false; // Device clear empties the output queue
+        device_listen = false;
+        device_talk = false;
+        device_srq = false;
+        status_byte = 0;
+    }
+    else if ((cmd_buf[0] == CMD_LLO) && (device_listen)) {
+        send_reply(cmd_buf, 1);
+    }
+    else if ((cmd_buf[0] == CMD_GTL) && (device_listen)) {
+        send_reply(cmd_buf, 1);
+    }
+    else if ((cmd_buf[0] == CMD_GET) && (device_listen)) {
+        send_reply(cmd_buf, 1);
+    }
+    output_high(NDAC);
 }
 
 void main(void) {
 	char writeError = 0;
+	char i;
+	char cause;
+	boolean warm;
 	char *buf_pnt = &buf[0];
 	
-	// Original Command Set
-	char addressBuf[4] = "+a:";
-	char timeoutBuf[4] = "+t:";
-	char eosBuf[6] = "+eos:";
-	char eoiBuf[6] = "+eoi:";
-	char testBuf[6] = "+test";
-	char readCmdBuf[6] = "+read";
-	char getCmdBuf[5] = "+get";
-	char stripBuf[8] = "+strip:";
-	char versionBuf[5] = "+ver";
-	char autoReadBuf[11] = "+autoread:";
-	char resetBuf[7] = "+reset";
-	char debugBuf[8] = "+debug:";
-	
-	// Prologix Compatible Command Set
-	char addrBuf[7] = "++addr";
-	char autoBuf[7] = "++auto";
-	char clrBuf[6] = "++clr";
-	char eotEnableBuf[13] = "++eot_enable";
-	char eotCharBuf[11] = "++eot_char";
-	char ifcBuf[6] = "++ifc";
-	char lloBuf[6] = "++llo";
-	char locBuf[6] = "++loc";
-	char lonBuf[6] = "++lon"; //TODO: Listen mode
-	char modeBuf[7] = "++mode";
-	char readTimeoutBuf[14] = "++read_tmo_ms";
-	char rstBuf[6] = "++rst";
-	char savecfgBuf[10] = "++savecfg";
-	char spollBuf[8] = "++spoll";
-	char srqBuf[6] = "++srq";
-	char statusBuf[9] = "++status";
-	char trgBuf[6] = "++trg";
-	char verBuf[6] = "++ver";
-	char helpBuf[7] = "++help"; //TODO
-	
+	/*
+	* The WDT is how the adapter recovers from a hang, and ++rst is how
+	* the PC resets it, so both should be back to work within a few ms.
+	* Only a power up or the reset button gets the full start up.
+	*/
+	cause = restart_cause();
+	warm = (cause == WDT_TIMEOUT) || (cause == RESET_INSTRUCTION);
 	
 	output_high(LED_ERROR); // Turn on the error LED
 	
+	for(i=0;i<31;++i) {
+	    latency_est[i] = latency_unknown;
+	}
+#ifdef WITH_HS_PROFILE
+	hs_clear();
+#endif
+	
 	// Setup the Watchdog Timer
 #ifdef WITH_WDT
 	setup_wdt(WDT_ON);
@@ -694,60 +2565,48 @@ void main(void) {
 	disable_interrupts(INT_TIMER2);
 #endif
 
+	// Free running timestamp for the bus monitor, 1.736us per tick
+	setup_timer_1(T1_INTERNAL | T1_DIV_BY_8);
+
     // Handle the EEPROM stuff
-    if (read_eeprom(0x00) == VALID_EEPROM_CODE) {
+    if (cfg_load()) {
+        if (baud_index >= baud_count) {
+            baud_index = 2;
+        }
+        uart_set_baud(baud_index);
+    }
+    else if (read_eeprom(0x00) == VALID_EEPROM_CODE) {
+        // Settings saved by older firmware, move them to the new store
         mode = read_eeprom(0x01);
         partnerAddress = read_eeprom(0x02);
         eot_char = read_eeprom(0x03);
         eot_enable = read_eeprom(0x04);
         eos_code = read_eeprom(0x05);
-        switch (eos_code) {
-            case 0:
-                eos_code = 0;
-                eos_string[0] = 13;
-                eos_string[1] = 10;
-                eos_string[2] = 0x00;
-                eos = 10;
-                break;
-            case 1:
-                eos_code = 1;
-                eos_string[0] = 13;
-                eos_string[1] = 0x00;
-                eos = 13;
-                break;
-            case 2:
-                eos_code = 2;
-                eos_string[0] = 10;
-                eos_string[1] = 0x00;
-                eos = 10;
-                break;
-            default:
-                eos_code = 3;
-                eos_string[0] = 0x00;
-                eos = 0;
-                break;
+        if (eos_code > 3) {
+            eos_code = 3; // The custom +eos:N character wasn't saved
         }
+        set_eos(eos_code);
         eoiUse = read_eeprom(0x06);
         autoread = read_eeprom(0x07);
         listen_only = read_eeprom(0x08);
         save_cfg = read_eeprom(0x09);
+        baud_index = read_eeprom(0x0A);
+        if (baud_index >= baud_count) {
+            baud_index = 2; // Saved before ++baud existed
+        }
+        uart_set_baud(baud_index);
+        cfg_dirty = true;
     }
-    else {
-        write_eeprom(0x00, VALID_EEPROM_CODE);
-        write_eeprom(0x01, 1); // mode
-        write_eeprom(0x02, 1); // partnerAddress
-        write_eeprom(0x03, 13); // eot_char
-        write_eeprom(0x04, 1); // eot_enable
-        write_eeprom(0x05, 3); // eos_code
-        write_eeprom(0x06, 1); // eoiUse
-        write_eeprom(0x07, 1); // autoread
-        write_eeprom(0x08, 0); // listen_only
-        write_eeprom(0x09, 1); // save_cfg
-    }
+    
+    mode = CONTROLLER_MODE; // Saved by a build with the other mode
+    
+    // Unused EEPROM fails the CRC check, so a fresh part has no profiles
+    profile_load();
+    set_partner(partnerAddress);
 	
 	// Start all the GPIB related stuff
 	gpib_init(); // Initialize the GPIB Bus
-	if (mode) {
+	if (CONTROLLER_MODE) {
 	    gpib_controller_assign(0x00);
     }
 
@@ -774,28 +2633,30 @@ void main(void) {
     * apt-get purge modemmanager
     */
 	output_low(LED_ERROR); // Turn off the error LED
-	restart_wdt();
-	delay_ms(100);
-	restart_wdt();
-	output_high(LED_ERROR);
-	restart_wdt();
-	delay_ms(100);
+	if (blink && !warm) {
+	    restart_wdt();
+	    delay_ms(100);
+	    restart_wdt();
+	    output_high(LED_ERROR);
+	    restart_wdt();
+	    delay_ms(100);
+	}
 	restart_wdt();
 	enable_interrupts(INT_RDA);
 	restart_wdt();
 	output_low(LED_ERROR);
 	
 	#ifdef VERBOSE_DEBUG
-	switch (restart_cause())
+	switch (cause)
 	{
 		case WDT_TIMEOUT:
 		{
-			printf("WDT restart\r\n");
+			printf(tx_put, "WDT restart\r\n");
 			break;
 		}
 		case NORMAL_POWER_UP:
 		{
-			printf("Normal power up\r\n");
+			printf(tx_put, "Normal power up\r\n");
 			break;
 		}
 	}
@@ -807,47 +2668,135 @@ void main(void) {
 #ifdef WITH_WDT
 		restart_wdt();
 #endif
+        if (!read_active) {
+            active_timeout = timeout; // Unless tmo_begin() picks a shorter one
+        }
+        ee_poll();
 
-		if(buf_in != buf_out) {
-			buf_pnt = buf_get(buf_pnt);
+        if ((!CONTROLLER_MODE) && listen_only) {
+            // Passive bus monitor, addressing is recorded but never acted on
+            monitor_poll();
+        }
+        else if ((!CONTROLLER_MODE) && !input(ATN)) {
+            // In device mode the controller's command bytes come before
+            // anything else, including host input. ATN is on RA1, which has
+            // no interrupt-on-change, so it is polled here and in host_poll.
+            device_atn();
+            continue;
+        }
+
+        if ((!CONTROLLER_MODE) && (!listen_only)) {
+            dev_hold_poll();
+        }
+        if (read_active) {
+            read_step();
+        }
+
+		// Input that comes in during a read, or that is held for the
+		// controller in device mode, waits in the ring, see host_poll().
+		if(host_poll()) {
+			buf_pnt = &buf[0];
+			stream_active = false; // Any line may re-address the bus
 			
 			if(*buf_pnt == '+') { // Controller commands start with a +
+			    // ++abort
+			    if(cmd_is(buf_pnt, "++abort")) {
+			        // RDA_isr already acted on it, anything it didn't end
+			        // was over before it arrived
+			        abort_req = false;
+			    }
 			    // +a:N
-				if(strncmp((char*)buf_pnt,(char*)addressBuf,3)==0) { 
-					partnerAddress = atoi((char*)(buf_pnt+3)); // Parse out the GPIB address
+				else if(cmd_is(buf_pnt, "+a:")) { 
+					set_partner(atoi((char*)(buf_pnt+3))); // Parse out the GPIB address
 				}
 				// ++addr N
-				else if(strncmp((char*)buf_pnt,(char*)addrBuf,6)==0) {
+				else if(cmd_is(buf_pnt, "++addr")) {
+				    if (*(buf_pnt+6) == 0x00) {
+				        reply_int(partnerAddress);
+				    }
+				    else if (*(buf_pnt+6) == 32) {
+				        set_partner(atoi((char*)(buf_pnt+7)));
+				    }
+				}
+				// ++baud N
+				else if(cmd_is(buf_pnt, "++baud")) {
 				    if (*(buf_pnt+6) == 0x00) {
-				        printf("%i%c", partnerAddress, eot_char);
+				        reply_int(baud_rates[baud_index]);
 				    }
 				    else if (*(buf_pnt+6) == 32) {
-				        partnerAddress = atoi((char*)(buf_pnt+7));
+				        baud_negotiate(atoi32((char*)(buf_pnt+7)));
 				    }
 				}
 				// +t:N
-				else if(strncmp((char*)buf_pnt,(char*)timeoutBuf,3)==0) { 
+				else if(cmd_is(buf_pnt, "+t:")) { 
 					timeout = atoi32((char*)(buf_pnt+3)); // Parse out the timeout period
 				}
 				// ++read_tmo_ms N
-				else if(strncmp((char*)buf_pnt,(char*)readTimeoutBuf,13)==0) {
+				else if(cmd_is(buf_pnt, "++read_tmo_ms")) {
 			        if (*(buf_pnt+13) == 0x00) {
-			            printf("%Lu%c", timeout, eot_char);
+			            reply_int(timeout);
 		            }
 		            else if (*(buf_pnt+13) == 32) {
 					    timeout = atoi32((char*)(buf_pnt+14));
 				    }
 				}
+				// ++tmo_adapt {0|1}
+				else if(cmd_is(buf_pnt, "++tmo_adapt")) {
+				    if (*(buf_pnt+11) == 0x00) {
+				        reply_int(tmo_adapt);
+				    }
+				    else if (*(buf_pnt+11) == 32) {
+				        tmo_adapt = atoi((char*)(buf_pnt+12));
+				        if ((tmo_adapt != 0) && (tmo_adapt != 1)) {
+				            tmo_adapt = 0; // If non-bool sent, set to disable
+				        }
+				    }
+				}
+				// ++tmo_mult N
+				else if(cmd_is(buf_pnt, "++tmo_mult")) {
+				    if (*(buf_pnt+10) == 0x00) {
+				        reply_int(tmo_mult);
+				    }
+				    else if (*(buf_pnt+10) == 32) {
+				        tmo_mult = atoi((char*)(buf_pnt+11));
+				        if (tmo_mult == 0) {
+				            tmo_mult = 1;
+				        }
+				    }
+				}
+				// ++tmo_floor N
+				else if(cmd_is(buf_pnt, "++tmo_floor")) {
+				    if (*(buf_pnt+11) == 0x00) {
+				        reply_int(tmo_floor);
+				    }
+				    else if (*(buf_pnt+11) == 32) {
+				        tmo_floor = atol((char*)(buf_pnt+12));
+				    }
+				}
+				// ++tmo_est
+				else if(cmd_is(buf_pnt, "++tmo_est")) {
+				    if (partnerAddress > 30) {
+				        reply_int(timeout);
+				    }
+				    else if (latency_est[partnerAddress] == latency_unknown) {
+				        sprintf(reply_buf, "- %Lu", tmo_effective(partnerAddress));
+				        send_reply(reply_buf, strlen(reply_buf));
+				    }
+				    else {
+				        sprintf(reply_buf, "%Lu %Lu", (unsigned int32)(latency_est[partnerAddress] >> 3), tmo_effective(partnerAddress));
+				        send_reply(reply_buf, strlen(reply_buf));
+				    }
+				}
 				// +read
-				else if((strncmp((char*)buf_pnt,(char*)readCmdBuf,5)==0) && (mode)) { 
+				else if((cmd_is(buf_pnt, "+read")) && (CONTROLLER_MODE)) { 
 					if(gpib_read(eoiUse)){
-					    if (debug == 1) {printf("Read error occured.%c", eot_char);}
+					    if (DEBUG_MSGS) {printf(tx_put, "Read error occured.%c", eot_char);}
 					    //delay_ms(1);
 						//reset_cpu();
 					}
 				}
 				// ++read
-				else if((strncmp((char*)buf_pnt+1,(char*)readCmdBuf,5)==0) && (mode)) {
+				else if((cmd_is(buf_pnt+1, "+read")) && (CONTROLLER_MODE)) {
 				    if (*(buf_pnt+6) == 0x00) {
 				        gpib_read(false); // read until EOS condition
 			        }
@@ -859,78 +2808,52 @@ void main(void) {
 			        }*/
 				}
 				// +test
-				else if(strncmp((char*)buf_pnt,(char*)testBuf,5)==0) { 
-					printf("testing%c", eot_char);
+				else if(cmd_is(buf_pnt, "+test")) { 
+					sprintf(reply_buf, "testing");
+					send_reply(reply_buf, 7);
 				}
 				// +eos:N
-				else if(strncmp((char*)buf_pnt,(char*)eosBuf,5)==0) { 
+				else if(cmd_is(buf_pnt, "+eos:")) { 
 					eos = atoi((char*)(buf_pnt+5)); // Parse out the end of string byte
-					eos_string[0] = eos;
-					eos_string[1] = 0x00;
-					eos_code = 4;
+					set_eos(4);
 				}
 				// ++eos {0|1|2|3}
-				else if(strncmp((char*)buf_pnt+1,(char*)eosBuf,4)==0) { 
+				else if(cmd_is(buf_pnt+1, "+eos")) { 
 					if (*(buf_pnt+5) == 0x00) {
-				        printf("%i%c", eos_code, eot_char);
+				        reply_int(eos_code);
 				    }
 				    else if (*(buf_pnt+5) == 32) {
-				        eos_code = atoi((char*)(buf_pnt+6));
-				        switch (eos_code) {
-				            case 0:
-				                eos_code = 0;
-				                eos_string[0] = 13;
-			                    eos_string[1] = 10;
-			                    eos_string[2] = 0x00;
-				                eos = 10;
-				                break;
-			                case 1:
-			                    eos_code = 1;
-			                    eos_string[0] = 13;
-			                    eos_string[1] = 0x00;
-			                    eos = 13;
-			                    break;
-		                    case 2:
-		                        eos_code = 2;
-		                        eos_string[0] = 10;
-		                        eos_string[1] = 0x00;
-		                        eos = 10;
-		                        break;
-	                        default:
-	                            eos_code = 3;
-	                            eos_string[0] = 0x00;
-	                            eos = 0;
-	                            break;
-				        }
+				        set_eos(atoi((char*)(buf_pnt+6)));
 				    }
 				}
 				// +eoi:{0|1}
-				else if(strncmp((char*)buf_pnt,(char*)eoiBuf,5)==0) { 
+				else if(cmd_is(buf_pnt, "+eoi:")) { 
 					eoiUse = atoi((char*)(buf_pnt+5)); // Parse out the end of string byte
 				}
 				// ++eoi {0|1}
-				else if(strncmp((char*)buf_pnt+1,(char*)eoiBuf,4)==0) { 
+				else if(cmd_is(buf_pnt+1, "+eoi")) { 
 					if (*(buf_pnt+5) == 0x00) {
-				        printf("%i%c", eoiUse, eot_char);
+				        reply_int(eoiUse);
 				    }
 				    else if (*(buf_pnt+5) == 32) {
 				        eoiUse = atoi((char*)(buf_pnt+6));
 				    }
 				}
 				// +strip:{0|1}
-				else if(strncmp((char*)buf_pnt,(char*)stripBuf,7)==0) { 
+				else if(cmd_is(buf_pnt, "+strip:")) { 
 					strip = atoi((char*)(buf_pnt+7)); // Parse out the end of string byte
 				}
 				// +ver
-				else if(strncmp((char*)buf_pnt,(char*)versionBuf,4)==0) { 
-					printf("%i%c", version, eot_char);
+				else if(cmd_is(buf_pnt, "+ver")) { 
+					reply_int(version);
 				}
 				// ++ver
-				else if(strncmp((char*)buf_pnt+1,(char*)versionBuf,4)==0) { 
-					printf("Version %i.0%c", version, eot_char);
+				else if(cmd_is(buf_pnt+1, "+ver")) { 
+					sprintf(reply_buf, "Version %u.0", version);
+					send_reply(reply_buf, strlen(reply_buf));
 				}
 				// +get
-				else if((strncmp((char*)buf_pnt,(char*)getCmdBuf,4)==0) && (mode)) { 
+				else if((cmd_is(buf_pnt, "+get")) && (CONTROLLER_MODE)) { 
 					if (*(buf_pnt+5) == 0x00) {
 				        writeError = writeError || addressTarget(partnerAddress);
 				        cmd_buf[0] = CMD_GET;
@@ -940,8 +2863,33 @@ void main(void) {
 				        TODO: Add support for specified addresses
 				    }*/
 				}
+				// ++t1 N
+				else if(cmd_is(buf_pnt, "++t1")) {
+				    if (*(buf_pnt+4) == 0x00) {
+				        reply_int(t1_profile);
+				    }
+				    else if (*(buf_pnt+4) == 32) {
+				        t1_profile = atoi((char*)(buf_pnt+5));
+				        if (t1_profile >= T1_COUNT) {
+				            t1_profile = T1_NONE;
+				        }
+				    }
+				}
+				// ++ton {0|1}
+				else if(cmd_is(buf_pnt, "++ton")) {
+				    if (*(buf_pnt+5) == 0x00) {
+				        reply_int(talk_only);
+				    }
+				    else if (*(buf_pnt+5) == 32) {
+				        talk_only = atoi((char*)(buf_pnt+6));
+				        if ((talk_only != 0) && (talk_only != 1)) {
+				            talk_only = 0; // If non-bool sent, set to disable
+				        }
+				        ton_addressed = false;
+				    }
+				}
 				// ++trg
-				else if((strncmp((char*)buf_pnt,(char*)trgBuf,5)==0) && (mode)) {
+				else if((cmd_is(buf_pnt, "++trg")) && (CONTROLLER_MODE)) {
 				    if (*(buf_pnt+5) == 0x00) {
 				        writeError = writeError || addressTarget(partnerAddress);
 				        cmd_buf[0] = CMD_GET;
@@ -951,14 +2899,26 @@ void main(void) {
 				        TODO: Add support for specified addresses
 				    }*/
 				}
+				// ++prefetch {0|1}
+				else if((cmd_is(buf_pnt, "++prefetch")) && (CONTROLLER_MODE)) {
+				    if (*(buf_pnt+10) == 0x00) {
+				        reply_int(prefetch);
+				    }
+				    else if (*(buf_pnt+10) == 32) {
+				        prefetch = atoi((char*)(buf_pnt+11));
+				        if ((prefetch != 0) && (prefetch != 1)) {
+				            prefetch = 0; // If non-bool sent, set to disable
+				        }
+				    }
+				}
 				// +autoread:{0|1}
-				else if(strncmp((char*)buf_pnt,(char*)autoReadBuf,10)==0) { 
+				else if(cmd_is(buf_pnt, "+autoread:")) { 
 					autoread = atoi((char*)(buf_pnt+10));
 				}
 				// ++auto {0|1}
-				else if(strncmp((char*)buf_pnt,(char*)autoBuf,6)==0) {
+				else if(cmd_is(buf_pnt, "++auto")) {
 				    if (*(buf_pnt+6) == 0x00) {
-				        printf("%i%c", autoRead, eot_char);
+				        reply_int(autoRead);
 				    }
 				    else if (*(buf_pnt+6) == 32) {
 				        autoread = atoi((char*)(buf_pnt+7));
@@ -968,23 +2928,50 @@ void main(void) {
 				    }
 				}
 				// +reset
-				else if(strncmp((char*)buf_pnt,(char*)resetBuf,6)==0) {
-				    delay_ms(1); 
+				else if(cmd_is(buf_pnt, "+reset")) {
+				    tx_drain();
 					reset_cpu();
 				}
+				// ++raw
+				else if((cmd_is(buf_pnt, "++raw")) && (CONTROLLER_MODE)) {
+				    raw_mode();
+				}
+				// ++blink {0|1}
+				else if(cmd_is(buf_pnt, "++blink")) {
+				    if (*(buf_pnt+7) == 0x00) {
+				        reply_int(blink);
+				    }
+				    else if (*(buf_pnt+7) == 32) {
+				        blink = atoi((char*)(buf_pnt+8));
+				        if ((blink != 0) && (blink != 1)) {
+				            blink = 1; // If non-bool sent, set to enable
+				        }
+				    }
+				}
+#ifdef WITH_HS_PROFILE
+				// ++hsprof [0]
+				else if(cmd_is(buf_pnt, "++hsprof")) {
+				    if (*(buf_pnt+8) == 0x00) {
+				        hs_dump(partnerAddress);
+				    }
+				    else if (*(buf_pnt+8) == 32) {
+				        hs_clear();
+				    }
+				}
+#endif
 				// ++rst
-				else if(strncmp((char*)buf_pnt,(char*)rstBuf,5)==0) {
-				    delay_ms(1); 
+				else if(cmd_is(buf_pnt, "++rst")) {
+				    tx_drain();
 					reset_cpu();
 				}
 				// +debug:{0|1}
-				else if(strncmp((char*)buf_pnt,(char*)debugBuf,7)==0) { 
+				else if(cmd_is(buf_pnt, "+debug:")) { 
 					debug = atoi((char*)(buf_pnt+7));
 				}
 				// ++debug {0|1}
-				else if(strncmp((char*)buf_pnt+1,(char*)debugBuf,6)==0) { 
+				else if(cmd_is(buf_pnt+1, "+debug")) { 
 					if (*(buf_pnt+7) == 0x00) {
-				        printf("%i%c", debug, eot_char);
+				        reply_int(debug);
 				    }
 				    else if (*(buf_pnt+7) == 32) {
 				        debug = atoi((char*)(buf_pnt+8));
@@ -994,7 +2981,7 @@ void main(void) {
 				    }
 				}
 				// ++clr
-				else if((strncmp((char*)buf_pnt,(char*)clrBuf,5)==0) && (mode)) {
+				else if((cmd_is(buf_pnt, "++clr")) && (CONTROLLER_MODE)) {
 				    // This command is special in that we must
 				    // address a specific instrument.
 				    writeError = writeError || addressTarget(partnerAddress);
@@ -1002,9 +2989,9 @@ void main(void) {
 					writeError = writeError || gpib_cmd(cmd_buf, 1);
 				}
 				// ++eot_enable {0|1}
-				else if(strncmp((char*)buf_pnt,(char*)eotEnableBuf,12)==0) {
+				else if(cmd_is(buf_pnt, "++eot_enable")) {
 				    if (*(buf_pnt+12) == 0x00) {
-				        printf("%i%c", eot_enable, eot_char);
+				        reply_int(eot_enable);
 				    }
 				    else if (*(buf_pnt+12) == 32) {
 				        eot_enable = atoi((char*)(buf_pnt+13));
@@ -1014,64 +3001,143 @@ void main(void) {
 				    }
 				}
 				// ++eot_char N
-				else if(strncmp((char*)buf_pnt,(char*)eotCharBuf,10)==0) {
+				else if(cmd_is(buf_pnt, "++eot_char")) {
 				    if (*(buf_pnt+10) == 0x00) {
-				        printf("%i%c", eot_char, eot_char);
+				        reply_int(eot_char);
 				    }
 				    else if (*(buf_pnt+10) == 32) {
 				        eot_char = atoi((char*)(buf_pnt+11));
 				    }
 				}
+				// ++frame {0|1}
+				else if(cmd_is(buf_pnt, "++frame")) {
+				    if (*(buf_pnt+7) == 0x00) {
+				        reply_int(framing);
+				    }
+				    else if (*(buf_pnt+7) == 32) {
+				        framing = atoi((char*)(buf_pnt+8));
+				        if ((framing != 0) && (framing != 1)) {
+				            framing = 0; // If non-bool sent, set to disable
+				        }
+				    }
+				}
+				// ++hs488 N
+				else if((cmd_is(buf_pnt, "++hs488")) && (CONTROLLER_MODE)) {
+				    if (*(buf_pnt+7) == 0x00) {
+				        reply_int(hs488);
+				    }
+				    else if (*(buf_pnt+7) == 32) {
+				        hs488 = atoi((char*)(buf_pnt+8));
+				        if (hs488 > 15) {
+				            hs488 = 15; // Longest cable CFGn can describe
+				        }
+				        if (hs488) {
+				            // Tell the devices how long the cable is
+				            cmd_buf[0] = CMD_CFE;
+				            cmd_buf[1] = CMD_CFG + hs488;
+				            if (gpib_cmd(cmd_buf, 2)) {
+				                if (DEBUG_MSGS) {printf(tx_put, "HS488 configuration failed.%c", eot_char);}
+				            }
+				        }
+				    }
+				}
 				// ++ifc
-				else if((strncmp((char*)buf_pnt,(char*)ifcBuf,5)==0) && (mode)) {
+				else if((cmd_is(buf_pnt, "++ifc")) && (CONTROLLER_MODE)) {
 				    output_low(IFC); // Assert interface clear.
 	                delay_us(150);
 	                output_float(IFC); // Finishing clearing interface
 				}
 				// ++llo
-				else if((strncmp((char*)buf_pnt,(char*)lloBuf,5)==0) && (mode)) {
+				else if((cmd_is(buf_pnt, "++llo")) && (CONTROLLER_MODE)) {
 				    writeError = writeError || addressTarget(partnerAddress);
 				    cmd_buf[0] = CMD_LLO;
 				    writeError = writeError || gpib_cmd(cmd_buf, 1);
 				}
 				// ++loc
-				else if((strncmp((char*)buf_pnt,(char*)locBuf,5)==0) && (mode)) {
+				else if((cmd_is(buf_pnt, "++loc")) && (CONTROLLER_MODE)) {
 				    writeError = writeError || addressTarget(partnerAddress);
 				    cmd_buf[0] = CMD_GTL;
 				    writeError = writeError || gpib_cmd(cmd_buf, 1);
 				}
 				// ++lon {0|1}
-				else if((strncmp((char*)buf_pnt,(char*)lonBuf,5)==0) && (!mode)) {
+				else if((cmd_is(buf_pnt, "++lon")) && (!CONTROLLER_MODE)) {
 				    if (*(buf_pnt+5) == 0x00) {
-				        printf("%i%c", listen_only, eot_char);
+				        reply_int(listen_only);
 				    }
 				    else if (*(buf_pnt+5) == 32) {
 				        listen_only = atoi((char*)(buf_pnt+6));
 				        if ((listen_only != 0) && (listen_only != 1)) {
 				            listen_only = 0; // If non-bool sent, set to disable
 				        }
+				        device_listen = false;
+				        device_talk = false;
+				        device_srq = false;
+				        prep_gpib_pins(); // Release NRFD/NDAC if the monitor stopped
+				        trace_wraps = 2; // First record has no previous one
 				    }
 				}
 				// ++mode {0|1}
-				else if(strncmp((char*)buf_pnt,(char*)modeBuf,6)==0) {
+				else if(cmd_is(buf_pnt, "++mode")) {
 				    if (*(buf_pnt+6) == 0x00) {
-				        printf("%i%c", mode, eot_char);
+				        reply_int(mode);
 				    }
 				    else if (*(buf_pnt+6) == 32) {
 				        mode = atoi((char*)(buf_pnt+7));
 				        if ((mode != 0) && (mode != 1)) {
 				            mode = 1; // If non-bool sent, set to control mode
 				        }
+				        mode = CONTROLLER_MODE; // Only keep modes built in
 				        prep_gpib_pins();
-				        if (mode) {
+				        if (CONTROLLER_MODE) {
 	                        gpib_controller_assign(0x00);
 				        }
+				        else {
+				            abort_req = false; // Seen before the switch
+				        }
+				    }
+				}
+				// ++pack_scale N
+				else if(cmd_is(buf_pnt, "++pack_scale")) {
+				    if (*(buf_pnt+12) == 0x00) {
+				        reply_int(pack_scale);
+				    }
+				    else if (*(buf_pnt+12) == 32) {
+				        pack_scale = atoi((char*)(buf_pnt+13));
+				        if (pack_scale > 9) {
+				            pack_scale = 9;
+				        }
+				    }
+				}
+				// ++pack {0|1|2}
+				else if(cmd_is(buf_pnt, "++pack")) {
+				    if (*(buf_pnt+6) == 0x00) {
+				        reply_int(pack);
+				    }
+				    else if (*(buf_pnt+6) == 32) {
+				        pack = atoi((char*)(buf_pnt+7));
+				        if (pack > PACK_INT) {
+				            pack = PACK_OFF;
+				        }
+				    }
+				}
+				// ++profile {0|1}
+				else if(cmd_is(buf_pnt, "++profile")) {
+				    if (*(buf_pnt+9) == 0x00) {
+				        reply_int(profile_find(partnerAddress) != profile_count);
+				    }
+				    else if (*(buf_pnt+9) == 32) {
+				        if (atoi((char*)(buf_pnt+10)) == 0) {
+				            profile_delete(partnerAddress);
+				        }
+				        else if (profile_save(partnerAddress)) {
+				            if (DEBUG_MSGS) {printf(tx_put, "Profile table full.%c", eot_char);}
+				        }
 				    }
 				}
 				// ++savecfg {0|1}
-				else if(strncmp((char*)buf_pnt,(char*)savecfgBuf,9)==0) {
+				else if(cmd_is(buf_pnt, "++savecfg")) {
 				    if (*(buf_pnt+9) == 0x00) {
-				        printf("%i%c", save_cfg, eot_char);
+				        reply_int(save_cfg);
 				    }
 				    else if (*(buf_pnt+9) == 32) {
 				        save_cfg = atoi((char*)(buf_pnt+10));
@@ -1079,24 +3145,16 @@ void main(void) {
 				            save_cfg = 1; // If non-bool sent, set to enable
 				        }
 				        if (save_cfg == 1) {
-				            write_eeprom(0x01, mode);
-                            write_eeprom(0x02, partnerAddress);
-                            write_eeprom(0x03, eot_char);
-                            write_eeprom(0x04, eot_enable);
-                            write_eeprom(0x05, eos_code);
-                            write_eeprom(0x06, eoiUse);
-                            write_eeprom(0x07, autoread);
-                            write_eeprom(0x08, listen_only);
-                            write_eeprom(0x09, save_cfg);
+				            cfg_dirty = true; // Written in the background by ee_poll()
 				        }
 				    }
 				}
 				// ++srq
-				else if((strncmp((char*)buf_pnt,(char*)srqBuf,5)==0) && (mode)) {
-				    printf("%i%c", srq_state(), eot_char);
+				else if((cmd_is(buf_pnt, "++srq")) && (CONTROLLER_MODE)) {
+				    reply_int(srq_state());
 				}
 				// ++spoll N
-				else if((strncmp((char*)buf_pnt,(char*)spollBuf,7)==0) && (mode)) {
+				else if((cmd_is(buf_pnt, "++spoll")) && (CONTROLLER_MODE)) {
 				    if (*(buf_pnt+7) == 0x00) {
 				        serial_poll(partnerAddress);
 				    }
@@ -1105,143 +3163,111 @@ void main(void) {
 				    }
 				}
 				// ++status
-				else if((strncmp((char*)buf_pnt,(char*)statusBuf,8)==0) && (!mode)) {
+				else if((cmd_is(buf_pnt, "++status")) && (!CONTROLLER_MODE)) {
 				    if (*(buf_pnt+8) == 0x00) {
-				       printf("%u%c", status_byte, eot_char);
+				       reply_int(status_byte);
 				    }
 				    else if (*(buf_pnt+8) == 32) {
 				        status_byte = atoi((char*)(buf_pnt+9));;
 				    }
 				}
 				else{
-				    if (debug == 1) {printf("Unrecognized command.%c", eot_char);}
+				    if (DEBUG_MSGS) {printf(tx_put, "Unrecognized command.%c", eot_char);}
 				}
 			} 
 			else { 
 		        // Not an internal command, send to bus
-			    // Command all talkers and listeners to stop
-			    // and tell target to listen.
-			    if (mode) {
+			    if (talk_only) {
+			        // Take the talker role once (only needed when we are the
+			        // controller) and keep streaming lines without
+			        // addressing, EOS handling still applies
+			        if (CONTROLLER_MODE) {
+			            tmo_begin(partnerAddress);
+			        }
+			        if (CONTROLLER_MODE && !ton_addressed) {
+			            writeError = addressTarget(partnerAddress);
+			            cmd_buf[0] = myAddress + 0x40;
+			            writeError = writeError || gpib_cmd(cmd_buf, 1);
+			            ton_addressed = !writeError;
+			        }
+			        if (!writeError) {
+			            writeError = write_line(buf_pnt);
+			        }
+			        if (CONTROLLER_MODE) {
+			            tmo_end(partnerAddress, writeError);
+			        }
+			        if (writeError) {
+			            xfer_error(FRAME_ERR_TIMEOUT);
+			            ton_addressed = false;
+			            writeError = 0;
+			        }
+			    }
+			    else if (!CONTROLLER_MODE) {
+			        // Device mode: host_poll() kept the line in the ring until
+			        // the controller addressed us to talk. Talk it, with EOI
+			        // on the last byte, then let the host send the next one,
+			        // as for packets. A bus monitor never talks, so the line
+			        // is dropped.
+			        if (!listen_only) {
+			            if (write_line(buf_pnt)) {
+			                bin_ack(FRAME_ERR_TIMEOUT);
+			            }
+			            else {
+			                bin_ack(FRAME_ERR_NONE);
+			            }
+			        }
+			    }
+			    else {
+			        // Command all talkers and listeners to stop
+			        // and tell target to listen.
+			        tmo_begin(partnerAddress);
 			        writeError = writeError || addressTarget(partnerAddress);
 			
 			        // Set the controller into talker mode
 			        cmd_buf[0] = myAddress + 0x40;
 			        writeError = writeError || gpib_cmd(cmd_buf, 1);
-		        }
 			
-			    // Send out command to the bus
-			    #ifdef VERBOSE_DEBUG
-			    printf("gpib_write: %s%c",buf_pnt, eot_char);
-			    #endif
-				
-				if (mode || device_talk) {
-				    if(eos_code != 3) { // If have an EOS char, need to output 
-				                        // termination byte to inst
-                        writeError = writeError || gpib_write(buf_pnt, 0, 0);
-                        if (!writeError)
-					        writeError = gpib_write(eos_string, 0, eoiUse);
-					    #ifdef VERBOSE_DEBUG
-				        printf("eos_string: %s",eos_string);
-				        #endif
-				    }
-				    else {
-				        writeError = writeError || gpib_write(buf_pnt, 0, 1);
-				    }
-				}
+			        // Send out command to the bus
+			        if (!writeError) {
+			            writeError = write_line(buf_pnt);
+			        }
+			        tmo_end(partnerAddress, writeError);
+			        if (writeError) {
+			            xfer_error(FRAME_ERR_TIMEOUT); // Still set after ++abort, no read
+			        }
 				
-				// If cmd contains a question mark -> is a query
-				if(autoread && mode) {
-				    if ((strchr((char*)buf_pnt, '?') != NULL) && !(writeError)) { 
-					    gpib_read(eoiUse);					    
+				    // If cmd contains a question mark -> is a query
+				    if(autoread) {
+				        if ((strchr((char*)buf_pnt, '?') != NULL) && !(writeError)) { 
+					        gpib_read(eoiUse);					    
+				        }
+				        else if(writeError){
+					        writeError = 0;
+				        }
 				    }
-				    else if(writeError){
-					    writeError = 0;
+				    else if (prefetch && !writeError) {
+				        prefetch_start();
 				    }
 				}
 			} // end of sending internal command
 
 		} // End of receiving PC input
 		
-        if (!mode) {
-            // When in device mode we should be checking the status of the 
-            // ATN line to see what we should be doing
-            if (!input(ATN)) {
-                if (!input(ATN)) {
-                    output_low(NDAC);
-                    gpib_receive(cmd_buf); // Get the CMD byte sent by the controller
-                    output_high(NRFD);
-                    if (cmd_buf[0] == partnerAddress + 0x40) {
-                        device_talk = true;
-                        #ifdef VERBOSE_DEBUG
-                        printf("Instructed to talk%c", eot_char);
-                        #endif
-                    }
-                    else if (cmd_buf[0] == partnerAddress + 0x20) {
-                        device_listen = true;
-                        #ifdef VERBOSE_DEBUG
-                        printf("Instructed to listen%c", eot_char);
-                        #endif
-                    }
-                    else if (cmd_buf[0] == CMD_UNL) {
-                        device_listen = false;
-                        #ifdef VERBOSE_DEBUG
-                        printf("Instructed to stop listen%c", eot_char);
-                        #endif
-                    }
-                    else if (cmd_buf[0] == CMD_UNT) {
-                        device_talk = false;
-                        #ifdef VERBOSE_DEBUG
-                        printf("Instructed to stop talk%c", eot_char);
-                        #endif
-                    }
-                    else if (cmd_buf[0] == CMD_SPE) {
-                        device_srq = true;
-                        #ifdef VERBOSE_DEBUG
-                        printf("SQR start%c", eot_char);
-                        #endif
-                    }
-                    else if (cmd_buf[0] == CMD_SPD) {
-                        device_srq = false;
-                        #ifdef VERBOSE_DEBUG
-                        printf("SQR end%c", eot_char);
-                        #endif
-                    }
-                    else if (cmd_buf[0] == CMD_DCL) {
-                        printf("%c%c", CMD_DCL, eot_char);
-                        device_listen = false;
-                        device_talk = false;
-                        device_srq = false;
-                        status_byte = 0;
-                    }
-                    else if ((cmd_buf[0] == CMD_LLO) && (device_listen)) {
-                        printf("%c%c", CMD_LLO, eot_char);
-                    }
-                    else if ((cmd_buf[0] == CMD_GTL) && (device_listen)) {
-                        printf("%c%c", CMD_GTL, eot_char);
-                    }
-                    else if ((cmd_buf[0] == CMD_GET) && (device_listen)) {
-                        printf("%c%c", CMD_GET, eot_char);
-                    }
-                    output_high(NDAC);
-                }
+        if ((!CONTROLLER_MODE) && (!listen_only) && input(ATN)) {
+            // Data phase of device mode. ATN was already checked at the top
+            // of the loop, so there is no need to wait for it to settle here.
+            if ((device_listen)) {
+                output_low(NDAC);
+                #ifdef VERBOSE_DEBUG
+                printf(tx_put, "Starting device mode gpib_read%c", eot_char);
+                #endif
+                gpib_read(eoiUse);
+                device_listen = false;
             }
-            else {
-                delay_us(10);
-                if(input(ATN)) {
-                    if ((device_listen)) {
-                        output_low(NDAC);
-                        #ifdef VERBOSE_DEBUG
-                        printf("Starting device mode gpib_read%c", eot_char);
-                        #endif
-                        gpib_read(eoiUse);
-                        device_listen = false;
-                    }
-                    else if (device_talk && device_srq) {
-                        gpib_write(&status_byte, 1, 0);
-                        device_srq = false;
-                        device_talk = false;
-                    }
-                }
+            else if (device_talk && device_srq) {
+                gpib_write(&status_byte, 1, 0);
+                device_srq = false;
+                device_talk = false;
             }
         }
 		
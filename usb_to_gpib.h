@@ -59,8 +59,44 @@
 #define CMD_GTL 0x1
 #define CMD_SPE 0x18
 #define CMD_SPD 0x19
+#define CMD_CFE 0x1f // Configuration enable, followed by CMD_CFG + n
+#define CMD_CFG 0x60 // HS488 cable length of n meters, secondary command
+
+// Binary packet sent by the host: BIN_START, flags, length, payload
+#define BIN_START 0x02
+#define BIN_EOI 0x01 // Assert EOI on the last payload byte
+#define BIN_READ 0x02 // Read the response once the payload is written
+#define BIN_MORE 0x04 // Another packet of the same message follows
+#define BIN_ACK 0x06 // Sent to the host once a packet has been consumed
+
+// ++raw escapes: RAW_ESC RAW_EXIT leaves raw mode, RAW_ESC RAW_EOM ends the
+// message and lets the instrument talk, RAW_ESC RAW_ESC sends RAW_ESC
+#define RAW_ESC 0x10 // DLE
+#define RAW_EXIT 0x03 // ETX
+#define RAW_EOM 0x04 // EOT
+
+// ++lon bus trace record: flags, data byte, delta (2 bytes, big-endian)
+#define TRACE_ATN 0x01
+#define TRACE_EOI 0x02
+#define TRACE_SRQ 0x04
+#define TRACE_OVF 0x08 // Delta was too long to count and is 0xFFFF
+
+// Response frame header flags (++frame 1)
+#define FRAME_END 0x01 // Last chunk of this response
+#define FRAME_EOI 0x02 // Response was terminated by EOI
+#define FRAME_ACK 0x04 // Binary packet acknowledgement, no payload
+#define FRAME_PACKED 0x08 // Payload is ++pack values, 4 bytes each
+
+// Response frame header error codes
+#define FRAME_ERR_NONE 0
+#define FRAME_ERR_TIMEOUT 1 // Handshake timeout while transferring data
+#define FRAME_ERR_ADDRESS 2 // No acceptor while addressing the bus
+#define FRAME_ERR_ABORT 3 // Transfer ended by ++abort
 
 extern char gpib_cmd( char *bytes, int length );
 extern char _gpib_write( char *bytes, int length, BOOLEAN attention, BOOLEAN useEOI);
+extern char gpib_write_begin( BOOLEAN attention );
+extern char gpib_write_byte( char a, BOOLEAN useEOI );
+extern void gpib_write_end( BOOLEAN attention );
 
 extern char gpib_receive( char *byt );
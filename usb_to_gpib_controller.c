@@ -0,0 +1,35 @@
+/*
+* GPIBUSB Adapter
+* usb_to_gpib_controller.c
+**
+* © 2013-2014 Steven Casagrande (scasagrande@galvant.ca).
+*
+* This file is a part of the GPIBUSB Adapter project.
+* Licensed under the AGPL version 3.
+**
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU Affero General Public License for more details.
+*
+* You should have received a copy of the GNU Affero General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+**
+*
+* Controller-only build profile. Device mode, the bus monitor and the
+* ++debug messages are left out, for the shortest handshake loops.
+*
+* See build_profiles.sh.
+*/
+
+#define BUILD_PROFILE
+#define WITH_TIMEOUT
+#define WITH_WDT
+#define WITH_CONTROLLER
+
+#include "usb_to_gpib.c"
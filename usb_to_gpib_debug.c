@@ -0,0 +1,40 @@
+/*
+* GPIBUSB Adapter
+* usb_to_gpib_debug.c
+**
+* © 2013-2014 Steven Casagrande (scasagrande@galvant.ca).
+*
+* This file is a part of the GPIBUSB Adapter project.
+* Licensed under the AGPL version 3.
+**
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU Affero General Public License for more details.
+*
+* You should have received a copy of the GNU Affero General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+**
+*
+* Debug build profile. Both modes, the ++debug messages and the
+* VERBOSE_DEBUG traces from inside the bus routines are built in, as
+* well as the ++hsprof handshake profiler.
+*
+* See build_profiles.sh.
+*/
+
+#define BUILD_PROFILE
+#define WITH_TIMEOUT
+#define WITH_WDT
+#define WITH_CONTROLLER
+#define WITH_DEVICE
+#define WITH_DEBUG_MSGS
+#define VERBOSE_DEBUG
+#define WITH_HS_PROFILE
+
+#include "usb_to_gpib.c"